@@ -0,0 +1,67 @@
+#!/bin/bash
+# Scaling benchmark: runs the monitor against 1, 2, 4 ... N simulated modems
+# (one modem_sim process serving N pseudo terminals) and prints one line per
+# step from the monitor's performance report. Every step goes through the
+# whole path: commands sent, responses framed and CSV rows written.
+#
+#   Usage: ./bench_scale.sh [max_devices] [seconds] [interval_ms] [latency_ms]
+
+MAX_DEVICES=${1:-1024}
+SECONDS_PER_STEP=${2:-10}
+INTERVAL_MS=${3:-1000}
+LATENCY_MS=${4:-20}
+
+if [ ! -x ./modem_monitor ] || [ ! -x ./modem_sim ]; then
+    echo "Build first: make" >&2
+    exit 1
+fi
+
+printf "%8s %12s %12s %8s %10s %10s %10s %12s %10s\n" \
+       "devices" "samples/s" "target/s" "%" "p50 ms" "p99 ms" "max ms" "cpu%/device" "rss KiB"
+
+n=1
+while [ "$n" -le "$MAX_DEVICES" ]; do
+    dir=$(mktemp -d /tmp/bench_scale.XXXXXX)
+
+    ./modem_sim -n "$n" -l "$dir/modem" -d "$LATENCY_MS" > "$dir/sim.log" 2>&1 &
+    sim=$!
+    for _ in $(seq 100); do
+        [ -e "$dir/modem$((n - 1))" ] && break
+        sleep 0.1
+    done
+
+    {
+        for ((d = 0; d < n; d++)); do
+            echo "device:$dir/modem$d"
+        done
+        echo "interval:$INTERVAL_MS"
+        echo "response_timeout:1000"
+        echo "output_format: csv"
+        echo "output_folder:$dir/data"
+        echo "commands: {"
+        echo "    AT+CSQ,"
+        echo "    AT+CREG?,"
+        echo "    AT+QENG=\"servingcell\","
+        echo "    AT+QTEMP"
+        echo "}"
+    } > "$dir/config.txt"
+
+    ./modem_monitor -c "$dir/config.txt" -q --duration "${SECONDS_PER_STEP}s" > "$dir/report.txt" 2>&1
+
+    awk -v n="$n" '
+        /^  Samples:/       { gsub(/[,%()]/, ""); rate = $3; target = $5; ratio = $7 }
+        /^  Cycle latency/  { gsub(/,/, ""); p50 = $5; p99 = $7; max = $9 }
+        /^  CPU:/           { gsub(/[,%]/, ""); per_device = $12 }
+        /^  Max RSS:/       { rss = $3 }
+        END {
+            if (rate == "") { printf "%8d  failed, see the monitor output\n", n; exit 1 }
+            sub(/\/s$/, "", rate); sub(/\/s$/, "", target)
+            printf "%8d %12s %12s %8s %10s %10s %10s %12s %10s\n", n, rate, target, ratio, p50, p99, max, per_device, rss
+        }' "$dir/report.txt" || cat "$dir/report.txt" >&2
+
+    kill "$sim" 2>/dev/null
+    wait "$sim" 2>/dev/null
+    rm -rf "$dir"
+
+    n=$((n * 2))
+done
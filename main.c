@@ -3,15 +3,20 @@
  *   This is program to gather data from a Quectel RM500Q-Gl modem. The read parameters can be passed 
  * via a configuration file or informed when running the application. The data is requested to the modem
  * via AT commands and are printed on the screen and stored in a csv file.   
+ * Several modems can be polled by one process: every `device:` line of the configuration file adds one,
+ * and each gets its own data file.
  *      
  * 
  *   @author Manoel Narciso Reis Soares Filho    
  * 
  */
 
+#define _GNU_SOURCE // SCHED_IDLE for the compression thread
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
@@ -19,42 +24,761 @@
 #include <ctype.h>
 #include <signal.h>
 #include <time.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <zlib.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "modem_record.h"
+#include "modem_shm.h"
 
 // Default values
 #define DEFAULT_DEVICE "/dev/ttyUSB3"
 #define DEFAULT_BAUD_RATE 115200
 #define DEFAULT_INTERVAL 1000 // Default interval in milliseconds
 #define DEFAULT_OUTPUT_FOLDER "." // Default output folder is the current directory
+#define DEFAULT_RESPONSE_TIMEOUT 1000 // Default deadline for a command's response in milliseconds
+#define RX_RING_SIZE 65536 // Size of the receive buffer of each device
+#define RESPONSE_INITIAL_SIZE 4096 // Initial capacity of a response buffer
+#define ROW_INITIAL_SIZE 16384 // Initial capacity of the CSV row buffer
+#define WRITER_BUFFER_SIZE 65536 // Bytes buffered by the data file writer
+#define DEFAULT_FLUSH_INTERVAL 1000 // Default flush interval of the data file in milliseconds
+#define DEFAULT_KEYFRAME_INTERVAL 600000 // Default keyframe interval of on-change columns in milliseconds
+#define DASHBOARD_WIDTH 100 // Characters per dashboard line
+#define DEFAULT_DASHBOARD_REFRESH 250 // Minimum time between dashboard redraws in milliseconds
+#define CLOCK_ANCHOR_INTERVAL 60 // Seconds between re-reading CLOCK_REALTIME
+#define OVERRUN_REPORT_INTERVAL 10 // Seconds between overrun messages on the verbose console
+#define URC_MAX_PER_CYCLE 16 // Unsolicited result codes kept between two recorded cycles
+#define URC_TEXT_MAX 128 // Longest unsolicited result code kept
+#define SAMPLE_QUEUE_SLOTS 64 // Cycles buffered for the writer thread, a power of two
+#define LIVE_RING_SLOTS 16 // Samples of each device kept in shared memory, a power of two
+#define METRICS_MAX_CLIENTS 4 // Scrapes served at the same time
+#define METRICS_REQUEST_MAX 2048 // Longest HTTP request header read
+#define METRICS_CLIENT_TIMEOUT 5000 // Milliseconds before an unfinished scrape may be dropped
+#define METRICS_LATENCY_BUCKETS 12 // Bounds of the command latency histograms
+#define SAMPLE_RESPONSE_MAX 4096 // Longest response carried to the writer thread
+#define COMPRESS_QUEUE_SIZE 64 // Finished segments waiting for compression
+#define OUTPUT_PATH_MAX 512 // Longest data file path
+#define BINARY_INDEX_STRIDE 64 // Cycles between entries of the binary offset index
+#define BINARY_INDEX_MAX 4096 // Entries kept per segment; the stride doubles when they run out
+#define CSV_INDEX_STRIDE 64 // Rows between entries of the sidecar index of CSV files
+#define SEND_TIMEOUT 1000 // Milliseconds a command line may wait for room in the serial output buffer
+#define PIPELINE_MAX_LINE 200 // Longest compound command line sent to the modem
+#define PIPELINE_MAX_BATCH 16 // Most commands joined into one compound line
+#define PIPELINE_REMERGE_CYCLES 100 // Clean cycles before isolated commands rejoin their compound lines
+#define MAX_DEVICES 1024 // Most modems monitored by one process
+#define EPOLL_BATCH 64 // Events taken from epoll_wait() at once
+#define IO_HISTOGRAM_BUCKETS 32 // Powers of two of the I/O latency histograms, in microseconds
+
+// Output formats
+#define OUTPUT_CSV 0
+#define OUTPUT_BINARY 1
+
+// Flush policies of the data file writer
+#define FLUSH_ROW 0      // Write every row as soon as it is complete
+#define FLUSH_ROWS 1     // Write every N rows
+#define FLUSH_INTERVAL 2 // Write when the oldest buffered row is T ms old
+
+// Fsync policies of the data file writer
+#define FSYNC_NONE 0     // Leave it to the kernel
+#define FSYNC_FLUSH 1    // fsync after every flush
+#define FSYNC_GROUP 2    // One fsync for all flushes in a T ms window
+
+// Typed fields extracted from responses
+#define FIELD_MAX 8            // Most columns one parser produces
+#define FIELD_MISSING INT_MIN  // Value not present in the response
+#define FIELD_TOKENS_MAX 32    // Most comma-separated values read from one line
+
+// What the monitor prints while polling
+#define CONSOLE_VERBOSE 0   // Every command and response of every cycle
+#define CONSOLE_QUIET 1     // Errors and the summary at exit only
+#define CONSOLE_DASHBOARD 2 // A table redrawn in place
+
+// Progress of a device through its cycle
+#define DEVICE_IDLE 0    // Waiting for the next tick
+#define DEVICE_POLLING 1 // A command line was sent, waiting for its final result code
+#define DEVICE_OFFLINE 2 // The port failed; the device is no longer polled
+
+// epoll tag of the scheduler timer; devices are tagged with their index
+#define EVENT_TIMER UINT64_MAX
+#define EVENT_METRICS (1ULL << 32) // Metrics listening socket, scrape client i is EVENT_METRICS + 1 + i
+
+// How a metrics series gets its value
+#define METRIC_TEXT 0    // HELP/TYPE line, no value
+#define METRIC_ULONG 1   // unsigned long counter
+#define METRIC_ULLONG 2  // unsigned long long counter
+#define METRIC_INT32 3   // Parsed value, FIELD_MISSING shown as NaN
+#define METRIC_UP 4      // Device state: 1 unless offline
+#define METRIC_MICROS 5  // long long microseconds, shown in seconds
+
+// Time-based rotation of the data file
+#define ROTATE_NONE 0
+#define ROTATE_HOURLY 1
+#define ROTATE_DAILY 2
 
 // Global variable to handle termination
 volatile sig_atomic_t running = 1;
 
+// Set by SIGUSR1, the event loop then prints the I/O counters
+volatile sig_atomic_t dump_requested = 0;
+
+// Heap allocations made while polling; stays at zero once the buffers fit
+// (the writer thread counts its own allocations here too)
+_Atomic unsigned long cycle_heap_allocations = 0;
+
+// CLOCK_REALTIME anchored to CLOCK_MONOTONIC
+// Wall-clock timestamps are derived from a single monotonic read; the anchor is
+// refreshed every CLOCK_ANCHOR_INTERVAL seconds to follow NTP adjustments.
+struct wall_clock {
+    long long realtime_ns;  // CLOCK_REALTIME at the anchor
+    long long monotonic_ns; // CLOCK_MONOTONIC at the anchor
+} wall_clock;
+
+// Date and time of the last formatted second, reused until the second changes
+struct timestamp_cache {
+    time_t second;
+    char prefix[24]; // "YYYY-MM-DD HH:MM:SS"
+    size_t len;
+};
+
+// Outcome of reading one command response
+struct response_info {
+    unsigned int wakeups; // Number of times poll() woke the process up
+    int complete;         // Non-zero once a final result code was received
+    int error;            // Non-zero if the final result code reports an error
+    long long rtt_us;     // Time from sending the command to its final result code
+    long long sent_ns;    // CLOCK_REALTIME when the command was written
+    long long received_ns; // CLOCK_REALTIME when the final result code arrived
+};
+
+// Round-trip times collected by --bench
+struct bench_samples {
+    int cycles;          // Cycles recorded so far
+    int max_cycles;
+    int command_count;
+    long long *rtt_us;   // max_cycles x command_count round-trip times
+    int *samples;        // Round-trip times recorded per command
+    int *failures;       // Responses per command that timed out or returned an error
+    long long *cycle_us; // Duration of each cycle
+};
+
+// Histogram of latencies in microseconds: exact below 16 us, then 8 buckets per
+// power of two (each at most 12.5% wide). Fixed size, so recording never allocates.
+#define HISTOGRAM_EXACT 16
+#define HISTOGRAM_SUB_BUCKETS 8
+#define HISTOGRAM_BUCKETS (HISTOGRAM_EXACT + 60 * HISTOGRAM_SUB_BUCKETS)
+struct latency_histogram {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long total;
+    long long max_us;
+};
+
+// Counter with a single writing thread that other threads may read
+// A relaxed load and store instead of a locked increment keeps the hot path cheap.
+#define STAT_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+
+// Histogram with one bucket per power of two, of microseconds or bytes
+// Bucket 0 holds 0 and bucket i holds [2^(i-1), 2^i); updated with STAT_ADD.
+struct io_histogram {
+    _Atomic unsigned long counts[IO_HISTOGRAM_BUCKETS];
+    _Atomic long long max;
+};
+
+// Counters of the system calls on the hot path, dumped on SIGUSR1 and at exit
+// The serial fields are only written by the event loop, the data file fields
+// only by the writer thread.
+struct io_stats {
+    _Atomic unsigned long serial_reads;       // read() on a serial port
+    _Atomic unsigned long long serial_read_bytes;
+    _Atomic unsigned long serial_eagain;      // Reads that found nothing
+    _Atomic unsigned long partial_reads;      // Reads that did not complete the response
+    _Atomic unsigned long serial_writes;      // write() of a command line
+    _Atomic unsigned long long serial_write_bytes;
+    _Atomic unsigned long short_writes;       // write() calls that took part of a command line
+    _Atomic unsigned long waits;              // poll() and epoll_wait()
+    _Atomic unsigned long drains;             // ioctl() for the bytes pending before a command
+    _Atomic unsigned long long drained_bytes; // Bytes found pending, classified instead of flushed
+    _Atomic unsigned long stray_lines;        // Lines outside a response that are not URCs
+    _Atomic unsigned long long drain_incomplete; // Incomplete lines the drains left buffered
+    _Atomic unsigned long timeouts;           // Responses past their deadline
+    struct io_histogram serial_write_latency;
+    struct io_histogram stray_per_cycle;      // Stray bytes received during one cycle
+    _Atomic unsigned long file_writes;        // write() to a data file
+    _Atomic unsigned long long file_write_bytes;
+    _Atomic unsigned long fsyncs;
+    struct io_histogram file_write_latency;
+};
+
+static struct io_stats io_stats;
+
+// Receive buffer of a serial device
+// Bytes are appended at head and consumed from tail, and scan remembers how far
+// the data has been searched for line boundaries, so every byte is examined once.
+// When the end of the storage is reached the unconsumed bytes (normally a partial
+// line) are moved back to the start instead of wrapping around, which keeps every
+// line contiguous so it can be handed out in place.
+struct rx_ring {
+    char *data;
+    size_t size;
+    size_t tail; // First unconsumed byte
+    size_t scan; // First byte not yet searched for '\n'
+    size_t head; // One past the last received byte
+};
+
+// Unsolicited result code received from the modem
+struct urc_event {
+    long long timestamp_ns; // CLOCK_REALTIME when the line was received
+    int stray;              // Not a URC: a line outside a response, e.g. a late reply
+    char text[URC_TEXT_MAX];
+};
+
+// Commands sent to the modem in one round trip
+// With pipelining off every batch holds a single command; otherwise compatible
+// extended commands are joined into a compound line such as AT+CSQ;+CREG?.
+struct command_batch {
+    int members[PIPELINE_MAX_BATCH]; // Indexes into the command list
+    int count;
+    char line[PIPELINE_MAX_LINE + 1]; // Command line sent for the batch
+};
+
+// Growable buffer holding the text of one response
+// The initial storage comes from the arena; a response that outgrows it moves
+// to the heap once and keeps that larger buffer for the following cycles.
+struct response_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    int heap; // Non-zero once data was allocated with malloc()
+};
+
+// Fixed region that long-lived buffers are carved from
+struct arena {
+    char *base;
+    size_t size;
+    size_t used;
+};
+
+// Sampling timeline of a device on CLOCK_MONOTONIC
+// Every command has its own period and absolute deadline, all starting from the
+// same instant, so commands with related periods fall on the same ticks and the
+// time spent polling does not push later samples back.
+struct scheduler {
+    int count;
+    long long *period_ns;   // Period of each command
+    struct timespec *next;  // Next deadline of each command
+    int skip_missed;        // Drop ticks that are already late instead of catching up
+    unsigned long ticks;    // Cycles started
+    unsigned long overruns; // Cycles that finished after a command's next deadline
+    unsigned long skipped;  // Command ticks dropped because of overruns
+    long long max_late_us;  // Worst overrun
+    unsigned long unreported;  // Overruns since the last console message
+    long long next_report_ns;  // CLOCK_MONOTONIC time before which overruns are not printed
+};
+
+// Per-cycle working memory, allocated once when the configuration is loaded
+struct cycle_state {
+    struct response_buf *responses; // Latest response of each command
+    struct response_info *infos;     // Outcome of each command
+    struct response_buf combined;    // Response to a compound line
+    struct response_buf row;         // CSV row being formatted
+    unsigned char *due;              // Commands sampled in this cycle
+    char timestamp[64];
+    long long timestamp_ns;          // CLOCK_REALTIME at the start of the cycle
+    struct timestamp_cache stamp_cache;
+    struct urc_event urcs[URC_MAX_PER_CYCLE]; // URCs received since the previous cycle
+    int urc_count;
+};
+
+// An opened serial device and the state machine polling it
+// A cycle walks through the command batches one request at a time: the event
+// loop sends a line, returns to epoll_wait() and continues when the final
+// result code arrives or the response deadline passes.
+struct modem_device {
+    int fd;
+    int index;              // Position in the device list, also its epoll tag
+    char *path;
+    char label[64];         // Name used for the data file and on the console
+    struct rx_ring rx;
+    const char *pending;    // Command line waiting for its response, NULL between commands
+    int record_urcs;        // Keep URCs for the data file instead of dropping them
+    struct urc_event urcs[URC_MAX_PER_CYCLE]; // URCs not yet handed to a cycle
+    int urc_count;
+    unsigned long urcs_seen;
+    unsigned long urcs_dropped; // URCs beyond URC_MAX_PER_CYCLE
+    // Cycle in progress
+    int state;                   // DEVICE_*
+    struct cycle_state cycle;
+    struct command_batch *batches; // Room for twice the command count (see isolate_failed_commands)
+    int batch_count;
+    struct command_batch *built_batches; // Batches as built from the configuration
+    int built_count;
+    int cycle_failed;            // A request of the running cycle failed or timed out
+    int drained;                 // The port was drained since the cycle started
+    unsigned long clean_cycles;  // Cycles without a failure since commands were isolated
+    int batch;                   // Batch being sent
+    int batch_end;               // Batches that existed when the cycle started
+    int fallback;                // Member of a failed compound line sent on its own, -1 if none
+    struct response_buf *target; // Receives the pending response
+    struct response_info *target_info;
+    struct response_info compound_info; // Outcome of a compound line
+    long long sent_mono_ns;      // CLOCK_MONOTONIC when the pending line was sent
+    long long deadline_ns;       // CLOCK_MONOTONIC deadline of the pending response
+    long long cycle_start_us;
+    long long tick_mono_ns;       // Tick of the running cycle, for its latency
+    struct modem_device *prev_waiting; // Devices waiting for a response, oldest first
+    struct modem_device *next_waiting;
+    // Ticks that came while a cycle was still running
+    unsigned char *next_due;
+    long long next_tick_ns;       // Monotonic
+    int missed;
+    unsigned long cycles;
+    unsigned long overruns;      // Ticks that found the previous cycle still running
+    unsigned long skipped;
+    unsigned long timeouts;      // Responses given up on at their deadline
+    unsigned long long rx_bytes; // Bytes read from and written to the port
+    unsigned long long tx_bytes;
+    unsigned long long stray_bytes; // Bytes outside a response that are not URCs
+    unsigned long cycle_stray;      // The same, in the cycle in progress
+    unsigned long stray_lines;      // Lines outside a response that are not URCs
+};
+
+// Durability settings of the data file
+// At most flush_rows rows or flush_interval_ms of data are lost if the process
+// dies, and at most the fsync window if the machine loses power.
+struct writer_policy {
+    int flush_mode;        // FLUSH_*
+    int flush_rows;
+    int flush_interval_ms;
+    int fsync_mode;        // FSYNC_*
+    int fsync_interval_ms;
+};
+
+// Buffered writer of the data file
+// Rows are collected in user space and handed to the kernel with one write()
+// according to the flush policy, then made durable according to the fsync policy.
+struct file_writer {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    struct writer_policy policy;
+    int rows_pending;           // Rows buffered since the last flush
+    long long first_pending_ms; // When the oldest buffered row was added
+    long long unsynced_ms;      // When the oldest unsynced flush happened, 0 if none
+    uint64_t flushed;           // Bytes of the current file handed to the kernel
+    uint64_t synced;            // Bytes of the current file known to be on disk
+    // Counters
+    unsigned long long bytes;   // Bytes handed to the kernel
+    unsigned long writes;       // write() calls
+    unsigned long fsyncs;
+    long long fsync_total_us;
+    long long fsync_max_us;
+};
+
+// When the data file is closed and a new segment started
+struct rotation_policy {
+    long long max_bytes; // Rotate once a segment reaches this size, 0 for no limit
+    int period;          // ROTATE_*: also rotate on hour or day boundaries
+    int compress;        // gzip finished segments in the background
+};
+
+// Background compression of finished segments
+// The sampling loop only queues paths; a worker thread running at idle
+// priority compresses them, so gzip never stalls a sample.
+struct compressor {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    char paths[COMPRESS_QUEUE_SIZE][OUTPUT_PATH_MAX];
+    int head;            // Next path to compress
+    int count;           // Paths queued
+    int stopping;
+    int started;
+    unsigned long compressed;
+    unsigned long failed;
+    unsigned long dropped; // Segments left uncompressed because the queue was full
+};
+
+// Extracts numeric columns from the response to one command
+// parse() fills values[0..field_count) (FIELD_MISSING where absent) and
+// returns 0, or -1 if the response has none of the expected lines.
+struct response_parser {
+    const char *command;       // Command it applies to, e.g. AT+CSQ
+    const char *prefix;        // Prefix of the information lines, e.g. +CSQ
+    const char *const *fields; // Column names
+    int field_count;
+    int (*parse)(const struct response_parser *parser, const char *data, size_t len, int values[]);
+};
+
+// One comma-separated value of an information line, quotes removed
+struct field_token {
+    const char *text;
+    size_t len;
+};
+
+// Destination of the sampled data
+struct output_sink {
+    int format;        // OUTPUT_CSV or OUTPUT_BINARY
+    struct file_writer writer;
+    char **commands;   // Columns, repeated in the header of every segment
+    int count;
+    const struct response_parser **parsers; // Parser of each command, NULL for raw text
+    const char *output_folder;
+    struct writer_policy policy;
+    struct rotation_policy rotation;
+    const char *label; // Device name added to file names, NULL with a single device
+    char filename[OUTPUT_PATH_MAX]; // Current segment
+    time_t segment_end; // Wall-clock boundary of the current segment, 0 if none
+    unsigned long segments;
+    struct compressor *compressor; // Shared by every device, NULL without compression
+    uint64_t offset;   // Bytes written so far
+    uint32_t cycle;    // Number of the next cycle written
+    const unsigned char *on_change; // Commands only recorded when their response changes
+    uint64_t *last_hash;   // Hash of the last recorded response of each command
+    unsigned char *emit;   // Commands written in the current cycle
+    long long keyframe_interval_ns; // Every on-change column is repeated this often
+    long long next_keyframe_ns;     // Due time of the next keyframe, 0 for the next cycle
+    unsigned long unchanged;        // Cells left out because nothing changed
+    int command_timestamps;         // CSV: add sent/received columns per command
+    int record_urcs;                // Add a URC column (CSV) or URC records (binary)
+    struct timestamp_cache stamp_cache; // Formatting of URC times
+    int index_fd;      // Sidecar index of a CSV segment, -1 if none
+    unsigned long segment_rows;          // Rows written to the current segment
+    struct modem_bin_index_entry *index; // Binary offset index, BINARY_INDEX_MAX entries, written on close;
+                                         // CSV entries whose rows are not flushed yet
+    size_t index_len;
+    uint32_t index_stride; // Cycles between index entries of the current segment
+};
+
+// Console output while polling
+// The dashboard keeps a copy of every line on screen and only rewrites the
+// lines that changed, at most once per refresh_ms, in a single write().
+struct console {
+    int mode;                      // CONSOLE_*
+    int refresh_ms;
+    long long next_refresh_ms;
+    unsigned long cycles;
+    char (*screen)[DASHBOARD_WIDTH + 1]; // Lines currently on the terminal
+    char *frame;                   // Escape sequences and text of one redraw
+    size_t frame_cap;
+    int lines;                     // Header plus one line per command of every device
+    int device_count;
+    long long *rtt_us;             // Last round-trip time of each command of each device
+    char *status;                  // Last outcome of each command: ' ', 'O', 'E' or 'T'
+    unsigned long redraws;
+    unsigned long lines_written;
+};
+
+// One polled cycle on its way to the writer thread
+struct sample_slot {
+    int device;
+    long long timestamp_ns;
+    char timestamp[64];
+    unsigned char *due;
+    struct response_info *infos;
+    uint32_t *lengths;
+    char *data;                 // SAMPLE_RESPONSE_MAX bytes per command
+    struct response_buf spill;  // Longer responses of the cycle, one after the other
+    struct urc_event urcs[URC_MAX_PER_CYCLE];
+    int urc_count;
+};
+
+// Single-producer/single-consumer queue between the polling loop and the writer thread
+// The polling loop copies each cycle into the next free slot and never waits for
+// the disk; when every slot is taken the cycle is dropped and counted instead.
+// Slots carry the index of their device, whose data file the writer picks.
+struct sample_queue {
+    struct sample_slot *slots;
+    unsigned long size;         // Slots, a power of two
+    int count;                  // Commands per slot
+    int device_count;
+    _Atomic unsigned long head; // Next slot to fill, advanced by the polling loop
+    _Atomic unsigned long tail; // Next slot to drain, advanced by the writer thread
+    sem_t ready;                // Posted once per queued cycle
+    _Atomic int stopping;
+    pthread_t thread;
+    int started;
+    struct output_sink *outs;   // Data file of each device, owned by the writer thread while it runs
+    struct cycle_state *cycles; // Writer's copy of the latest responses of each device
+    struct live_ring *live;     // Shared-memory samples, NULL when not published
+    unsigned long queued;
+    unsigned long dropped;      // Cycles lost because the writer fell behind
+    unsigned long spilled;      // Responses longer than SAMPLE_RESPONSE_MAX, carried in a spill buffer
+    unsigned long truncated;    // Responses cut because their spill buffer could not grow
+    unsigned long max_depth;    // Deepest the queue has been
+    int behind;                 // Dropping since the last successful push
+};
+
+// Writer side of the live samples in shared memory (see modem_shm.h)
+// Only the writer thread publishes, so one writer per sequence lock.
+struct live_ring {
+    const char *name;          // Name of the shared-memory object
+    unsigned char *base;
+    size_t size;
+    struct modem_shm_header *header;
+    struct modem_shm_device *devices;
+    unsigned char *slots;
+    int count;                 // Commands
+    const struct response_parser **parsers; // Parser of each command, NULL if it has no values
+    int *first_field;          // Index of the first value of each command
+    int32_t *latest;           // Current values, device_count x field_count
+};
+
+// Prometheus histogram of command round-trip times, buckets cumulative
+struct metrics_histogram {
+    unsigned long buckets[METRICS_LATENCY_BUCKETS];
+    unsigned long count;
+    long long sum_us;
+};
+
+// One line of the metrics text: pre-rendered name and labels, then a value
+struct metrics_series {
+    size_t name;       // Offset of "name{labels} " in the names text
+    size_t name_len;
+    int kind;          // METRIC_*
+    const void *value; // Counter, gauge or bucket it shows
+};
+
+// Scrape connection
+struct metrics_client {
+    int fd;            // -1 when the slot is free
+    char request[METRICS_REQUEST_MAX];
+    size_t request_len;
+    char *response;    // Sized at startup for the largest possible scrape
+    size_t response_len;
+    size_t sent;
+    long long accepted_ms;
+};
+
+// Loopback HTTP endpoint in Prometheus text format
+// Served from the event loop: sockets are non-blocking and a scrape only
+// copies pre-rendered names and formats numbers.
+struct metrics_server {
+    int listen_fd;
+    int epoll_fd;
+    char *names;                   // Text of every series up to its value
+    size_t names_len;
+    size_t names_cap;
+    struct metrics_series *series;
+    int series_count;
+    int series_cap;
+    size_t response_max;
+    struct metrics_client clients[METRICS_MAX_CLIENTS];
+    int count;                     // Commands
+    const struct response_parser **parsers; // Parser of each command, NULL if it has no values
+    int *first_field;              // Index of the first value of each command
+    int field_count;
+    int32_t *values;               // Latest parsed values, device_count x field_count
+    struct metrics_histogram *latency; // Per command
+    unsigned long scrapes;
+};
+
+// Single-threaded event loop polling every device
+// One epoll set holds the serial ports and a timerfd armed at the next
+// scheduler deadline. All devices follow the same timeline, so the samples of
+// one tick carry the same timestamp whichever modem they come from.
+struct event_loop {
+    int epoll_fd;
+    int timer_fd;
+    struct modem_device *devices;
+    int device_count;
+    int online;                  // Devices not offline
+    struct scheduler *sched;
+    unsigned char *due;          // Commands due on the current tick
+    char **commands;
+    int count;
+    int timeout_ms;              // Response deadline
+    struct sample_queue *queue;
+    struct console *console;
+    struct bench_samples *bench; // --bench: cycles run back to back, NULL when monitoring
+    struct metrics_server *metrics; // Scrape endpoint, NULL when disabled
+    int bench_started;
+    struct modem_device *waiting_head; // Oldest pending request, so the first deadline
+    struct modem_device *waiting_tail;
+    unsigned long wakeups;       // Returns from epoll_wait()
+    long long duration_ns;       // --duration: time to run, 0 until shutdown
+    long long start_ns;          // When the loop started and stopped (monotonic)
+    long long end_ns;
+    unsigned long samples;       // Responses collected (due commands of finished cycles)
+    struct latency_histogram cycle_latency; // Tick to end of cycle, every device
+};
+
 // Function prototypes
 int configure_serial_port(int fd, int baud_rate);
-int send_at_command(int fd, const char *command);
-void flush_serial_port(int fd);
-int read_response(int fd, char *response, size_t max_len);
-int request_modem_property(int fd, const char *command, char *response, size_t max_len);
-void process_commands(int fd, char *commands[], int count, FILE *csv_file);
-int read_config_file(const char *filename, char **device, int *baud_rate, char *commands[], int max_count, int *interval, char **output_folder);
+int rx_ring_init(struct rx_ring *ring, size_t size);
+void rx_ring_free(struct rx_ring *ring);
+ssize_t rx_ring_fill(struct rx_ring *ring, int fd);
+int rx_ring_next_line(struct rx_ring *ring, const char **line, size_t *len);
+int response_append(struct response_buf *resp, const char *data, size_t len);
+int arena_init(struct arena *arena, size_t size);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_free(struct arena *arena);
+int cycle_state_init(struct cycle_state *cycle, struct arena *arena, int count);
+void cycle_state_free(struct cycle_state *cycle, int count);
+int send_at_command(struct modem_device *dev, const char *command);
+void flush_serial_port(struct modem_device *dev);
+int final_result_code(const char *line, size_t len);
+int frame_response(struct modem_device *dev, struct response_buf *resp, struct response_info *info);
+int read_response(struct modem_device *dev, struct response_buf *resp, int timeout_ms, struct response_info *info);
+int request_modem_property(struct modem_device *dev, const char *command, struct response_buf *resp, int timeout_ms, struct response_info *info);
+int is_unsolicited(const struct modem_device *dev, const char *line, size_t len);
+void record_urc(struct modem_device *dev, const char *line, size_t len, int stray);
+int scan_unsolicited(struct modem_device *dev);
+void process_unsolicited(struct event_loop *loop, struct modem_device *dev);
+void take_urcs(struct modem_device *dev, struct cycle_state *cycle);
+int subscribe_urcs(struct modem_device *dev, struct response_buf *resp, int timeout_ms);
+int command_prefix(const char *command, char *prefix, size_t max_len);
+int pipeline_compatible(const char *command);
+int build_command_batches(char *commands[], const int periods[], int count, int pipeline, struct command_batch batches[]);
+int split_compound_response(const struct command_batch *batch, char *commands[], const struct response_buf *combined, struct response_buf responses[]);
+void isolate_failed_commands(struct command_batch batches[], int *batch_count, int b, char *commands[], const struct response_info infos[]);
+int device_open(struct modem_device *dev, int index, const char *path, int baud_rate, struct arena *arena, int count);
+void device_close(struct modem_device *dev, int count);
+void device_start_cycle(struct event_loop *loop, struct modem_device *dev, const unsigned char due[], long long tick_mono_ns);
+void device_advance(struct event_loop *loop, struct modem_device *dev);
+int device_send(struct event_loop *loop, struct modem_device *dev, const char *line, struct response_buf *resp, struct response_info *info, int flush);
+void device_request_done(struct event_loop *loop, struct modem_device *dev, int failed);
+void device_finish_cycle(struct event_loop *loop, struct modem_device *dev);
+void device_readable(struct event_loop *loop, struct modem_device *dev);
+void device_timeout(struct event_loop *loop, struct modem_device *dev);
+void device_offline(struct event_loop *loop, struct modem_device *dev);
+void waiting_remove(struct event_loop *loop, struct modem_device *dev);
+int event_loop_init(struct event_loop *loop, struct modem_device *devices, int device_count, struct scheduler *sched, struct arena *arena, char *commands[], int count, int timeout_ms, struct sample_queue *queue, struct console *console);
+int event_loop_run(struct event_loop *loop);
+void event_loop_tick(struct event_loop *loop);
+void event_loop_close(struct event_loop *loop);
+void performance_report(const struct event_loop *loop);
+int metrics_open(struct metrics_server *m, struct event_loop *loop, int port);
+void metrics_record_cycle(struct metrics_server *m, const struct modem_device *dev);
+void metrics_event(struct metrics_server *m, uint64_t tag);
+void metrics_close(struct metrics_server *m);
+void histogram_add(struct latency_histogram *h, long long us);
+void io_histogram_add(struct io_histogram *h, long long value);
+long long io_histogram_percentile(const struct io_histogram *h, int percent);
+void io_stats_dump(FILE *out);
+long long histogram_percentile(const struct latency_histogram *h, int percent);
+int bench_init(struct bench_samples *bench, int cycles, int command_count);
+void bench_record(struct bench_samples *bench, const struct response_info infos[], long long cycle_us);
+void bench_report(const struct bench_samples *bench, char *commands[]);
+void bench_free(struct bench_samples *bench);
+int read_config_file(const char *filename, char *devices[], int *device_count, int max_devices, int *baud_rate, char *commands[], int periods[], unsigned char on_change[], int max_count, int *interval, char **output_folder, int *response_timeout, int *pipeline, int *skip_missed, int *output_format, struct writer_policy *policy, struct rotation_policy *rotation, int *keyframe_interval, int *command_timestamps, int *console_mode, int *dashboard_refresh, int *record_urcs, int *urc_subscribe, char **shm_name, int *metrics_port);
+int parse_duration_ms(const char *value);
+int split_command_period(char *command);
+int split_command_flags(char *command);
+int scheduler_init(struct scheduler *sched, struct arena *arena, int count, const int periods[], int interval_ms, int skip_missed);
+int scheduler_arm(struct scheduler *sched, int timer_fd);
+void scheduler_collect(struct scheduler *sched, unsigned char due[]);
+void scheduler_advance(struct scheduler *sched, const unsigned char due[], int verbose);
+int parse_bool(const char *value);
+long long monotonic_ms(void);
+long long monotonic_us(void);
+long long monotonic_ns(void);
+long long realtime_ns(long long monotonic);
+int format_timestamp(struct timestamp_cache *cache, long long timestamp_ns, char *buf);
 void to_lowercase(char *str);
 void trim_whitespace(char *str);
 void remove_surrounding_quotes(char *str);
 void signal_handler(int signum);
-FILE *create_csv_file(char *commands[], int count, const char *output_folder);
+int format_output_filename(char *filename, size_t max_len, const char *output_folder, const char *label, const char *extension);
+int writer_open(struct file_writer *w, const char *filename, const struct writer_policy *policy);
+int writer_append(struct file_writer *w, const void *data, size_t len);
+int writer_end_row(struct file_writer *w);
+int writer_flush(struct file_writer *w);
+int writer_sync(struct file_writer *w);
+int writer_idle(struct file_writer *w, long long idle_ms);
+long long writer_deadline_ms(const struct file_writer *w);
+int writer_close(struct file_writer *w);
+int parse_writer_policy(const char *key, const char *value, struct writer_policy *policy);
+int create_csv_file(struct file_writer *w, char *commands[], const struct response_parser *parsers[], int count, int command_timestamps, int record_urcs, const char *output_folder, const char *label, const struct writer_policy *policy, char *filename, uint64_t *offset);
+int create_binary_file(struct file_writer *w, char *commands[], int count, int record_urcs, const char *output_folder, const char *label, const struct writer_policy *policy, char *filename, uint64_t *offset);
+int output_open(struct output_sink *out, int format, char *commands[], const unsigned char on_change[], int count, const char *output_folder, const char *label, const struct writer_policy *policy, const struct rotation_policy *rotation, struct compressor *compressor, int keyframe_interval_ms, int command_timestamps, int record_urcs);
+int output_open_segment(struct output_sink *out);
+void output_close_segment(struct output_sink *out);
+int output_rotate(struct output_sink *out);
+time_t next_rotation_boundary(time_t now, int period);
+long long parse_size_bytes(const char *value);
+int compressor_start(struct compressor *c);
+void compressor_submit(struct compressor *c, const char *path);
+void compressor_stop(struct compressor *c);
+void *compressor_main(void *arg);
+int compress_file(const char *path);
+void output_write_cycle(struct output_sink *out, struct cycle_state *cycle, int count);
+int write_csv_row(struct output_sink *out, struct cycle_state *cycle, int count);
+const struct response_parser *find_response_parser(const char *command);
+int next_information_line(const char **pos, const char *end, const char *prefix, const char **line, size_t *len);
+int split_fields(const char *line, size_t len, struct field_token tokens[], int max);
+int field_int(const struct field_token *token, int *value);
+int parse_leading_ints(const struct response_parser *parser, const char *data, size_t len, int values[]);
+int parse_servingcell(const struct response_parser *parser, const char *data, size_t len, int values[]);
+int parse_max_temperature(const struct response_parser *parser, const char *data, size_t len, int values[]);
+int csv_append_quoted(struct response_buf *row, const char *text, size_t len);
+int csv_append_raw_response(struct response_buf *row, const char *data, size_t len);
+int write_binary_records(struct output_sink *out, const struct cycle_state *cycle, int count);
+void select_changed_responses(struct output_sink *out, const struct cycle_state *cycle, int count);
+uint64_t hash_response(const char *data, size_t len);
+void output_close(struct output_sink *out);
+int csv_index_open(struct output_sink *out);
+int csv_index_append(struct output_sink *out, long long timestamp_ns);
+int csv_index_write(struct output_sink *out);
+int live_ring_open(struct live_ring *live, const char *name, char *commands[], int count, const struct modem_device *devices, int device_count);
+void live_ring_publish(struct live_ring *live, int device, const struct cycle_state *cycle);
+void live_ring_close(struct live_ring *live);
+int sample_queue_init(struct sample_queue *q, struct arena *arena, int count, int device_count, struct output_sink *outs, struct live_ring *live);
+int sample_queue_push(struct sample_queue *q, int device, const struct cycle_state *cycle);
+void sample_queue_stop(struct sample_queue *q);
+void sample_queue_free(struct sample_queue *q);
+void *writer_thread_main(void *arg);
+int console_init(struct console *console, int mode, int refresh_ms, int count, int device_count);
+void dashboard_update(struct console *console, const struct modem_device *devices, char *commands[], int count, int updated);
+void dashboard_close(struct console *console);
+size_t response_summary(const char *data, size_t len, const char **text);
+int start_thread(pthread_t *thread, void *(*main)(void *), void *arg);
 
 // Main function
 int main(int argc, char *argv[]) {
-    char *device = NULL;
+    char *devices[MAX_DEVICES]; // Serial ports, one per modem
+    int device_count = 0;
     int baud_rate = DEFAULT_BAUD_RATE; // Default baud rate
     int interval = DEFAULT_INTERVAL;   // Default interval in milliseconds
+    int response_timeout = DEFAULT_RESPONSE_TIMEOUT; // Default response deadline in milliseconds
+    int pipeline = 0; // Join compatible commands into compound lines
+    int skip_missed = 0; // Skip ticks missed after an overrun instead of catching up
+    int output_format = OUTPUT_CSV; // Format of the data file
+    struct writer_policy policy = { FLUSH_INTERVAL, 1, DEFAULT_FLUSH_INTERVAL, FSYNC_NONE, 0 };
+    struct rotation_policy rotation = { 0, ROTATE_NONE, 0 }; // One ever-growing file by default
     char *output_folder = DEFAULT_OUTPUT_FOLDER; // Default output folder
     int command_count = 0;
     char *commands[100]; // Adjust the size as needed
-
-    // Initialize default device if not provided
-    device = strdup(DEFAULT_DEVICE);
+    int periods[100] = {0}; // Per-command polling period in milliseconds, 0 for the interval
+    unsigned char on_change[100] = {0}; // Per-command "record on change" flag
+    int keyframe_interval = DEFAULT_KEYFRAME_INTERVAL; // Milliseconds between full rows of on-change columns
+    int command_timestamps = 0; // Add per-command sent/received columns to CSV files
+    int console_mode = CONSOLE_VERBOSE; // What to print while polling
+    int dashboard_refresh = DEFAULT_DASHBOARD_REFRESH; // Minimum milliseconds between dashboard redraws
+    int console_option = -1; // --quiet or --dashboard, overrides the configuration file
+    int record_urcs = 0; // Record unsolicited result codes as events
+    int urc_subscribe = 0; // Enable registration and indication URCs at startup
+    int bench_cycles = 0; // Number of cycles to run with --bench, 0 to monitor
+    int duration_ms = 0; // Stop after --duration, 0 to run until interrupted
+    char *shm_name = NULL; // Shared-memory object for live samples, NULL to not publish them
+    int metrics_port = 0; // Port of the Prometheus endpoint on 127.0.0.1, 0 to disable it
 
     // Check for the -c flag
     int file_mode = 0;
@@ -69,70 +793,247 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "Error: -c flag requires a filename.\n");
                 return 1;
             }
+        } else if (strcmp(argv[i], "--quiet") == 0 || strcmp(argv[i], "-q") == 0) {
+            console_option = CONSOLE_QUIET;
+        } else if (strcmp(argv[i], "--dashboard") == 0) {
+            console_option = CONSOLE_DASHBOARD;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                bench_cycles = atoi(argv[++i]);
+            } else {
+                fprintf(stderr, "Error: --bench flag requires a number of cycles.\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            if (i + 1 < argc && (duration_ms = parse_duration_ms(argv[i + 1])) > 0) {
+                i++;
+            } else {
+                fprintf(stderr, "Error: --duration flag requires a time such as 30s or 5min.\n");
+                return 1;
+            }
         } else {
+            on_change[command_count] = split_command_flags(argv[i]);
+            periods[command_count] = split_command_period(argv[i]);
             commands[command_count++] = argv[i];
         }
     }
 
     if (file_mode) {
         // Read configuration from the file
-        int count = read_config_file(filename, &device, &baud_rate, commands, sizeof(commands) / sizeof(commands[0]), &interval, &output_folder);
+        int count = read_config_file(filename, devices, &device_count, MAX_DEVICES, &baud_rate, commands, periods, on_change, sizeof(commands) / sizeof(commands[0]), &interval, &output_folder, &response_timeout, &pipeline, &skip_missed, &output_format, &policy, &rotation, &keyframe_interval, &command_timestamps, &console_mode, &dashboard_refresh, &record_urcs, &urc_subscribe, &shm_name, &metrics_port);
         if (count < 0) {
             fprintf(stderr, "Error reading configuration from file '%s'\n", filename);
-            free(device);
+            for (int d = 0; d < device_count; d++) {
+                free(devices[d]);
+            }
             return 1;
         }
         command_count = count;
     }
+    if (console_option >= 0) {
+        console_mode = console_option;
+    }
+
+    // Use the default device if none was configured
+    if (device_count == 0) {
+        devices[device_count++] = strdup(DEFAULT_DEVICE);
+    }
+
+    // Every device needs a descriptor for its port and its data file
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < (rlim_t)device_count * 3 + 64) {
+        files.rlim_cur = files.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &files) != 0) {
+            perror("Warning: could not raise the open file limit");
+        }
+    }
 
-    int fd = open(device, O_RDWR | O_NOCTTY | O_NDELAY);
-    if (fd == -1) {
-        perror("open");
-        free(device);
+    // Allocate all per-cycle state up front so polling does not touch the heap:
+    // a cycle state and batches for every device on each side of the sample queue
+    struct arena arena;
+    struct scheduler sched;
+    size_t per_command = sizeof(struct response_buf) + sizeof(struct response_info) + RESPONSE_INITIAL_SIZE +
+                         sizeof(long long) + sizeof(struct timespec) + 1;
+    size_t per_cycle_state = (size_t)command_count * (per_command + 64) + RESPONSE_INITIAL_SIZE + ROW_INITIAL_SIZE + 256;
+    size_t per_device = 2 * per_cycle_state + 2 * (size_t)command_count * (sizeof(struct command_batch) + 1) + 64;
+    if (arena_init(&arena, (size_t)device_count * per_device + per_cycle_state) != 0 ||
+        scheduler_init(&sched, &arena, command_count, periods, interval, skip_missed) != 0) {
         return 1;
     }
 
-    // Configure the serial port
-    if (configure_serial_port(fd, baud_rate) != 0) {
-        close(fd);
-        free(device);
+    struct modem_device *modems = calloc(device_count, sizeof(modems[0]));
+    if (modems == NULL) {
+        perror("Error allocating memory for devices");
+        arena_free(&arena);
         return 1;
     }
+    int opened = 0;
+    for (; opened < device_count; opened++) {
+        struct modem_device *dev = &modems[opened];
+        if (device_open(dev, opened, devices[opened], baud_rate, &arena, command_count) != 0) {
+            break;
+        }
+        dev->record_urcs = record_urcs;
+
+        // Group the commands into the lines sent to the modem
+        dev->batch_count = build_command_batches(commands, periods, command_count, pipeline, dev->batches);
+        dev->built_count = dev->batch_count;
+        memcpy(dev->built_batches, dev->batches, dev->batch_count * sizeof(dev->batches[0]));
+
+        // Ask the modem to report registration changes and indications by itself
+        if (urc_subscribe) {
+            subscribe_urcs(dev, &dev->cycle.combined, response_timeout);
+        }
+    }
 
     // Set up signal handling for graceful termination
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, signal_handler);
 
-    // Create the CSV file
-    FILE *csv_file = create_csv_file(commands, command_count, output_folder);
-    if (csv_file == NULL) {
-        close(fd);
-        free(device);
+    // Set up the console before the first cycle
+    struct console console;
+    struct output_sink *outs = calloc(device_count, sizeof(outs[0]));
+    struct compressor compressor = { 0 };
+    int outputs = 0;
+    if (opened < device_count || outs == NULL ||
+        console_init(&console, console_mode, dashboard_refresh, command_count, device_count) != 0) {
+        for (int d = 0; d < opened; d++) {
+            device_close(&modems[d], command_count);
+        }
+        free(outs);
+        free(modems);
+        arena_free(&arena);
+        return 1;
+    }
+
+    // Create a data file per device, the live samples if published, and start the writer thread
+    struct sample_queue queue;
+    struct event_loop loop;
+    struct live_ring live = { 0 };
+    int result = rotation.compress ? compressor_start(&compressor) : 0;
+    for (; result == 0 && outputs < device_count; outputs++) {
+        result = output_open(&outs[outputs], output_format, commands, on_change, command_count, output_folder,
+                             device_count > 1 ? modems[outputs].label : NULL, &policy, &rotation,
+                             rotation.compress ? &compressor : NULL, keyframe_interval, command_timestamps, record_urcs);
+    }
+    if (result == 0 && shm_name != NULL) {
+        result = live_ring_open(&live, shm_name, commands, command_count, modems, device_count);
+    }
+    if (result != 0 || sample_queue_init(&queue, &arena, command_count, device_count, outs,
+                                         shm_name != NULL ? &live : NULL) != 0) {
+        for (int d = 0; d < outputs; d++) {
+            output_close(&outs[d]);
+        }
+        live_ring_close(&live);
+        compressor_stop(&compressor);
+        dashboard_close(&console);
+        for (int d = 0; d < device_count; d++) {
+            device_close(&modems[d], command_count);
+        }
+        free(outs);
+        free(modems);
+        arena_free(&arena);
         return 1;
     }
 
-    // Main loop to send commands at the specified interval
-    while (running) {
-        process_commands(fd, commands, command_count, csv_file);
+    // Poll every device from one event loop
+    struct bench_samples bench;
+    struct metrics_server metrics;
+    result = event_loop_init(&loop, modems, device_count, &sched, &arena, commands, command_count, response_timeout, &queue, &console);
+    if (result == 0 && metrics_port > 0) {
+        result = metrics_open(&metrics, &loop, metrics_port);
+    }
+    if (result == 0 && bench_cycles > 0) {
+        // Benchmark: run the cycles back to back and report round-trip times
+        result = bench_init(&bench, bench_cycles, command_count);
+        loop.bench = result == 0 ? &bench : NULL;
+    }
+    if (result == 0) {
+        loop.duration_ns = duration_ms * 1000000LL;
+        event_loop_run(&loop);
+    }
+    if (loop.bench != NULL) {
+        bench_report(&bench, commands);
+        bench_free(&bench);
+    }
+    if (loop.metrics != NULL) {
+        metrics_close(&metrics);
+    }
+    event_loop_close(&loop);
 
-        // Sleep for the specified interval
-        usleep(interval * 1000); // Convert milliseconds to microseconds
+    dashboard_close(&console);
+    unsigned long overruns = sched.overruns, skipped = sched.skipped;
+    unsigned long urcs_seen = 0, urcs_dropped = 0;
+    for (int d = 0; d < device_count; d++) {
+        overruns += modems[d].overruns;
+        skipped += modems[d].skipped;
+        urcs_seen += modems[d].urcs_seen;
+        urcs_dropped += modems[d].urcs_dropped;
+    }
+    if (bench_cycles == 0) {
+        printf("Cycles: %lu, overruns: %lu (worst %.1f ms late), skipped ticks: %lu\n", sched.ticks, overruns,
+               sched.max_late_us / 1000.0, skipped);
+    }
+    if (urcs_seen > 0) {
+        printf("Unsolicited result codes: %lu, not recorded (too many per cycle): %lu\n", urcs_seen, urcs_dropped);
     }
 
-    // Close the CSV file
-    fclose(csv_file);
+    // Let the writer thread drain the queue, then close the data files
+    sample_queue_stop(&queue);
+    printf("Sample queue: %lu cycles queued, max depth %lu/%lu, dropped %lu, long responses %lu, truncated responses %lu\n",
+           queue.queued, queue.max_depth, queue.size, queue.dropped, queue.spilled, queue.truncated);
+    printf("Heap allocations while polling: %lu\n", (unsigned long)cycle_heap_allocations);
+    live_ring_close(&live);
+    struct file_writer totals = { 0 };
+    unsigned long unchanged = 0, segments = 0;
+    for (int d = 0; d < device_count; d++) {
+        output_close(&outs[d]);
+        totals.bytes += outs[d].writer.bytes;
+        totals.writes += outs[d].writer.writes;
+        totals.fsyncs += outs[d].writer.fsyncs;
+        totals.fsync_total_us += outs[d].writer.fsync_total_us;
+        if (outs[d].writer.fsync_max_us > totals.fsync_max_us) {
+            totals.fsync_max_us = outs[d].writer.fsync_max_us;
+        }
+        unchanged += outs[d].unchanged;
+        segments += outs[d].segments;
+    }
+    compressor_stop(&compressor);
+    printf("Data %s: %llu bytes in %lu writes, %lu fsyncs (avg %.3f ms, max %.3f ms)\n",
+           device_count > 1 ? "files" : "file", totals.bytes, totals.writes, totals.fsyncs,
+           totals.fsyncs ? totals.fsync_total_us / 1000.0 / totals.fsyncs : 0.0,
+           totals.fsync_max_us / 1000.0);
+    if (unchanged > 0) {
+        printf("Unchanged responses not recorded: %lu\n", unchanged);
+    }
+    if (rotation.max_bytes > 0 || rotation.period != ROTATE_NONE) {
+        printf("Segments: %lu, compressed: %lu, compression failures: %lu, left uncompressed: %lu\n",
+               segments, compressor.compressed, compressor.failed, compressor.dropped);
+    }
+    io_stats_dump(stdout);
+    performance_report(&loop); // After the writer thread is done, so its CPU time counts
+    sample_queue_free(&queue);
 
-    // Close the serial port
-    close(fd);
+    // Close the serial ports
+    for (int d = 0; d < device_count; d++) {
+        device_close(&modems[d], command_count);
+    }
+    free(outs);
+    free(modems);
+    arena_free(&arena);
 
     // Free dynamically allocated memory
-    free(device);
+    for (int d = 0; d < device_count; d++) {
+        free(devices[d]);
+    }
     if (file_mode) {
         for (int i = 0; i < command_count; i++) {
             free(commands[i]);
         }
         free(output_folder);
     }
+    free(shm_name);
 
     return 0;
 }
@@ -168,9 +1069,10 @@ int configure_serial_port(int fd, int baud_rate) {
     // Disable output processing
     tty.c_oflag &= ~OPOST;
 
-    // Set read timeout
-    tty.c_cc[VMIN] = 0;    // Non-blocking read
-    tty.c_cc[VTIME] = 10;  // 1 second timeout (10 deciseconds)
+    // Non-blocking reads: the port is opened with O_NDELAY and read_response()
+    // waits for data with poll(), so VMIN/VTIME must not add their own timeout
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
 
     if (tcsetattr(fd, TCSANOW, &tty) != 0) {
         perror("tcsetattr");
@@ -181,299 +1083,4248 @@ int configure_serial_port(int fd, int baud_rate) {
 }
 
 // Function to send AT command
-int send_at_command(int fd, const char *command) {
+// The port is non-blocking, so a line the output buffer cannot take at once is
+// finished after waiting for POLLOUT; a modem must never see half a command.
+int send_at_command(struct modem_device *dev, const char *command) {
     // Create a buffer to hold the command with '\r' added
     char cmd_with_cr[256];
     snprintf(cmd_with_cr, sizeof(cmd_with_cr), "%s\r", command);
 
     // Send the command
-    ssize_t n = write(fd, cmd_with_cr, strlen(cmd_with_cr));
-    if (n < 0) {
-        perror("write");
-        return -1;
+    size_t len = strlen(cmd_with_cr);
+    size_t sent = 0;
+    long long start = monotonic_us();
+    long long deadline = start + SEND_TIMEOUT * 1000LL;
+    while (sent < len) {
+        ssize_t n = write(dev->fd, cmd_with_cr + sent, len - sent);
+        STAT_ADD(io_stats.serial_writes, 1);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("write");
+            return -1;
+        }
+        if (n > 0) {
+            sent += n;
+            dev->tx_bytes += n;
+            STAT_ADD(io_stats.serial_write_bytes, n);
+            if (sent < len) {
+                STAT_ADD(io_stats.short_writes, 1);
+            }
+            continue;
+        }
+
+        // Output buffer full: wait until it drains
+        long long remaining = deadline - monotonic_us();
+        if (remaining <= 0) {
+            fprintf(stderr, "Timed out writing '%s' to %s\n", command, dev->label);
+            return -1;
+        }
+        struct pollfd pfd = { .fd = dev->fd, .events = POLLOUT };
+        STAT_ADD(io_stats.waits, 1);
+        if (poll(&pfd, 1, (int)((remaining + 999) / 1000)) < 0 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
     }
+    io_histogram_add(&io_stats.serial_write_latency, monotonic_us() - start);
 
     return 0;
 }
 
-// Function to flush the serial port
-void flush_serial_port(int fd) {
-    tcflush(fd, TCIOFLUSH);
+// Function to drain the serial port before a command
+// What arrived since the last response (a late reply, a URC) is read without
+// blocking and classified instead of flushed: URCs are recorded and other lines
+// counted as stray. Nothing is thrown away; a line still incomplete at the end
+// stays buffered and is classified by the framer once it is complete.
+void flush_serial_port(struct modem_device *dev) {
+    size_t drained = 0;
+    int queued = 0;
+    if (ioctl(dev->fd, FIONREAD, &queued) != 0) {
+        queued = 0;
+    }
+    STAT_ADD(io_stats.drains, 1);
+
+    // Read no more than was pending, so a chatty modem cannot hold the drain
+    while (queued > 0) {
+        ssize_t n = rx_ring_fill(&dev->rx, dev->fd);
+        if (n <= 0) {
+            break; // A failed port is noticed by the event loop
+        }
+        queued -= n;
+        drained += n;
+        dev->rx_bytes += n;
+        scan_unsolicited(dev);
+    }
+    scan_unsolicited(dev);
+
+    // Bytes kept from an earlier drain were counted when they were read
+    if (drained > 0) {
+        size_t incomplete = dev->rx.head - dev->rx.tail;
+        STAT_ADD(io_stats.drained_bytes, drained);
+        STAT_ADD(io_stats.drain_incomplete, incomplete < drained ? incomplete : drained);
+    }
 }
 
-// Function to read response
-int read_response(int fd, char *response, size_t max_len) {
-    size_t total_read = 0;
-    int bytes_read;
+// Function to allocate the receive buffer of a device
+int rx_ring_init(struct rx_ring *ring, size_t size) {
+    ring->data = malloc(size);
+    if (ring->data == NULL) {
+        perror("Error allocating memory for receive buffer");
+        return -1;
+    }
+    ring->size = size;
+    ring->tail = ring->scan = ring->head = 0;
+    return 0;
+}
 
-    // Loop until we either read enough data or reach the end of the timeout
-    while (total_read < max_len - 1) {
-        bytes_read = read(fd, response + total_read, max_len - total_read - 1);
+// Function to release the receive buffer of a device
+void rx_ring_free(struct rx_ring *ring) {
+    free(ring->data);
+    ring->data = NULL;
+}
 
-        if (bytes_read < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // Resource temporarily unavailable, continue reading
-                continue;
-            }
-            perror("read");
-            return -1;
-        } else if (bytes_read == 0) {
-            // No more data available
-            break;
-        }
+// Function to read whatever the device has available into the receive buffer
+// Returns the number of bytes read, 0 on end of file and -1 on error (errno set).
+ssize_t rx_ring_fill(struct rx_ring *ring, int fd) {
+    // Move the unconsumed bytes back to the start when the end is reached
+    if (ring->head == ring->size && ring->tail > 0) {
+        size_t pending = ring->head - ring->tail;
+        memmove(ring->data, ring->data + ring->tail, pending);
+        ring->scan -= ring->tail;
+        ring->head = pending;
+        ring->tail = 0;
+    }
 
-        total_read += bytes_read;
+    ssize_t n = read(fd, ring->data + ring->head, ring->size - ring->head);
+    STAT_ADD(io_stats.serial_reads, 1);
+    if (n > 0) {
+        ring->head += n;
+        STAT_ADD(io_stats.serial_read_bytes, n);
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        STAT_ADD(io_stats.serial_eagain, 1);
+    }
+    return n;
+}
 
-        // Check if the end of the response is reached
-        if (strchr(response, '\n') != NULL) {
-            break;
+// Function to take the next complete line out of the receive buffer
+// Only bytes that arrived since the last call are searched. On success the line
+// (including its terminator) is returned in place and stays valid until the next
+// rx_ring_fill(). A line that fills the whole buffer is returned as it is.
+int rx_ring_next_line(struct rx_ring *ring, const char **line, size_t *len) {
+    char *nl = memchr(ring->data + ring->scan, '\n', ring->head - ring->scan);
+    size_t end;
+
+    if (nl != NULL) {
+        end = (size_t)(nl - ring->data) + 1;
+    } else if (ring->tail == 0 && ring->head == ring->size) {
+        end = ring->head; // Buffer full without a line break
+    } else {
+        ring->scan = ring->head;
+        return 0;
+    }
+
+    *line = ring->data + ring->tail;
+    *len = end - ring->tail;
+    ring->tail = ring->scan = end;
+
+    // Rewind an empty buffer so the whole storage is available again
+    if (ring->tail == ring->head) {
+        ring->tail = ring->scan = ring->head = 0;
+    }
+    return 1;
+}
+
+// Function to append text to a response, growing it as needed
+int response_append(struct response_buf *resp, const char *data, size_t len) {
+    if (resp->len + len + 1 > resp->cap) {
+        size_t cap = resp->cap ? resp->cap : RESPONSE_INITIAL_SIZE;
+        while (resp->len + len + 1 > cap) {
+            cap *= 2;
+        }
+        char *grown = resp->heap ? realloc(resp->data, cap) : malloc(cap);
+        if (grown == NULL) {
+            perror("Error allocating memory for response");
+            return -1;
+        }
+        if (!resp->heap && resp->len > 0) {
+            memcpy(grown, resp->data, resp->len); // Move out of the arena
         }
+        resp->data = grown;
+        resp->cap = cap;
+        resp->heap = 1;
+        cycle_heap_allocations++;
     }
 
-    response[total_read] = '\0'; // Null-terminate the string
-    return total_read;
+    memcpy(resp->data + resp->len, data, len);
+    resp->len += len;
+    resp->data[resp->len] = '\0';
+    return 0;
 }
 
-// Function to request modem property (send AT command and get the response)
-int request_modem_property(int fd, const char *command, char *response, size_t max_len) {
-    // Send the AT command
-    if (send_at_command(fd, command) != 0) {
-        return -1;
+// Function to get a monotonic timestamp in milliseconds
+long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Function to classify a response line as a 3GPP final result code
+// Returns 0 for intermediate lines, 1 for a successful final result code and
+// -1 for a final result code that reports an error.
+int final_result_code(const char *line, size_t len) {
+    static const char *const success_codes[] = { "OK", "CONNECT" };
+    static const char *const error_codes[] = { "ERROR", "NO CARRIER", "NO DIALTONE", "BUSY", "NO ANSWER" };
+
+    // Ignore the line terminator
+    while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == '\n')) {
+        len--;
     }
 
-    // Read the response
-    if (read_response(fd, response, max_len) < 0) {
+    for (size_t i = 0; i < sizeof(success_codes) / sizeof(success_codes[0]); i++) {
+        if (len == strlen(success_codes[i]) && memcmp(line, success_codes[i], len) == 0) {
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < sizeof(error_codes) / sizeof(error_codes[0]); i++) {
+        if (len == strlen(error_codes[i]) && memcmp(line, error_codes[i], len) == 0) {
+            return -1;
+        }
+    }
+
+    // +CME ERROR: <err> and +CMS ERROR: <err> carry an error code
+    if ((len >= 11 && memcmp(line, "+CME ERROR:", 11) == 0) ||
+        (len >= 11 && memcmp(line, "+CMS ERROR:", 11) == 0)) {
         return -1;
     }
 
     return 0;
 }
 
-// Function to process a list of commands
-void process_commands(int fd, char *commands[], int count, FILE *csv_file) {
-    char response[1024];
-    char *responses[count];
+// Function to get a monotonic timestamp in nanoseconds
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    for (int i = 0; i < count; i++) {
-        responses[i] = malloc(1024); // Allocate memory for each response
-        if (responses[i] == NULL) {
-            perror("Error allocating memory for response");
-            return;
-        }
+// Function to convert a CLOCK_MONOTONIC reading to CLOCK_REALTIME nanoseconds
+// Only the polling loop calls this, so the anchor needs no locking.
+long long realtime_ns(long long monotonic) {
+    if (wall_clock.monotonic_ns == 0 || monotonic - wall_clock.monotonic_ns >= CLOCK_ANCHOR_INTERVAL * 1000000000LL) {
+        struct timespec real;
+        clock_gettime(CLOCK_REALTIME, &real);
+        wall_clock.monotonic_ns = monotonic_ns();
+        wall_clock.realtime_ns = (long long)real.tv_sec * 1000000000LL + real.tv_nsec;
     }
+    return wall_clock.realtime_ns + (monotonic - wall_clock.monotonic_ns);
+}
 
-    // Send each command and store responses
-    for (int i = 0; i < count; i++) {
-        const char *at_command = commands[i];
+// Function to format a timestamp as "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" (local time)
+// localtime_r() and the date are only redone when the second changes; the
+// fraction is written digit by digit. buf must hold 30 bytes. Returns the length.
+int format_timestamp(struct timestamp_cache *cache, long long timestamp_ns, char *buf) {
+    time_t second = timestamp_ns / 1000000000LL;
+    long fraction = timestamp_ns % 1000000000LL;
 
-        // Flush the serial port before sending a new command
-        flush_serial_port(fd);
+    if (second != cache->second) {
+        struct tm t;
+        localtime_r(&second, &t);
+        cache->len = strftime(cache->prefix, sizeof(cache->prefix), "%Y-%m-%d %H:%M:%S", &t);
+        cache->second = second;
+    }
 
-        // Send the AT command and get the response
-        if (request_modem_property(fd, at_command, responses[i], sizeof(response)) != 0) {
-            fprintf(stderr, "Error processing command '%s'\n", at_command);
-            strcpy(responses[i], "ERROR"); // Indicate an error
-        }
+    memcpy(buf, cache->prefix, cache->len);
+    char *p = buf + cache->len;
+    *p++ = '.';
+    for (int d = 8; d >= 0; d--) {
+        p[d] = '0' + fraction % 10;
+        fraction /= 10;
     }
+    p[9] = '\0';
+    return cache->len + 10;
+}
 
-    // Get the current timestamp
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char timestamp[256];
-    snprintf(timestamp, sizeof(timestamp), "%04d-%02d-%02d %02d:%02d:%02d",
-             t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-             t->tm_hour, t->tm_min, t->tm_sec);
+// Function to get a monotonic timestamp in microseconds
+long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    // Print and write each response
-    printf("Timestamp: %s\n", timestamp);
-    fprintf(csv_file, "\"%s\"", timestamp);
+// Function to reserve the memory of an arena
+int arena_init(struct arena *arena, size_t size) {
+    arena->base = malloc(size);
+    if (arena->base == NULL) {
+        perror("Error allocating memory for arena");
+        return -1;
+    }
+    arena->size = size;
+    arena->used = 0;
+    return 0;
+}
 
-    for (int i = 0; i < count; i++) {
-        printf("Command: %s\nResponse: %s\n\n", commands[i], responses[i]);
-        fprintf(csv_file, ",\"%s\"", responses[i]);
-        free(responses[i]); // Free the memory after use
+// Function to carve a block out of an arena (16-byte aligned)
+void *arena_alloc(struct arena *arena, size_t size) {
+    size_t start = (arena->used + 15) & ~(size_t)15;
+    if (start + size > arena->size) {
+        fprintf(stderr, "Arena exhausted (%zu of %zu bytes used)\n", arena->used, arena->size);
+        return NULL;
     }
+    arena->used = start + size;
+    return arena->base + start;
+}
 
-    // Write a newline to the CSV file to finish the row
-    fprintf(csv_file, "\n");
+// Function to release an arena and everything carved from it
+void arena_free(struct arena *arena) {
+    free(arena->base);
+    arena->base = NULL;
 }
 
-// Function to read configuration from a file
-int read_config_file(const char *filename, char **device, int *baud_rate, char *commands[], int max_count, int *interval, char **output_folder) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("Error opening configuration file");
-        fprintf(stderr, "File path provided: %s\n", filename); // Additional debug info
+// Function to give a response buffer its initial storage from the arena
+static int response_buf_init(struct response_buf *buf, struct arena *arena, size_t cap) {
+    buf->data = arena_alloc(arena, cap);
+    if (buf->data == NULL) {
         return -1;
     }
+    buf->data[0] = '\0';
+    buf->len = 0;
+    buf->cap = cap;
+    buf->heap = 0;
+    return 0;
+}
 
-    char line[256];
-    int count = 0;
-    int in_commands_block = 0;
-    char command_buffer[1024] = {0}; // Buffer to accumulate commands across lines
-
-    // Default output folder
-    *output_folder = strdup(DEFAULT_OUTPUT_FOLDER);
-    if (*output_folder == NULL) {
-        perror("Error allocating memory for output folder");
-        fclose(file);
+// Function to set up the per-cycle working memory
+int cycle_state_init(struct cycle_state *cycle, struct arena *arena, int count) {
+    cycle->responses = arena_alloc(arena, count * sizeof(struct response_buf));
+    cycle->infos = arena_alloc(arena, count * sizeof(struct response_info));
+    cycle->due = arena_alloc(arena, count);
+    if ((count > 0 && (cycle->responses == NULL || cycle->infos == NULL || cycle->due == NULL)) ||
+        response_buf_init(&cycle->combined, arena, RESPONSE_INITIAL_SIZE) != 0 ||
+        response_buf_init(&cycle->row, arena, ROW_INITIAL_SIZE) != 0) {
         return -1;
     }
 
-    while (fgets(line, sizeof(line), file) != NULL) {
-        // Remove trailing newline characters
-        line[strcspn(line, "\r\n")] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (response_buf_init(&cycle->responses[i], arena, RESPONSE_INITIAL_SIZE) != 0) {
+            return -1;
+        }
+    }
+    memset(cycle->infos, 0, count * sizeof(struct response_info));
+    memset(cycle->due, 1, count);
+    cycle->timestamp[0] = '\0';
+    cycle->stamp_cache.second = -1;
+    cycle->urc_count = 0;
+    return 0;
+}
 
-        // Convert to lowercase for case-insensitive comparison
-        char lower_line[256];
-        strncpy(lower_line, line, sizeof(lower_line));
-        lower_line[sizeof(lower_line) - 1] = '\0';
-        to_lowercase(lower_line);
+// Function to release the buffers that outgrew the arena
+void cycle_state_free(struct cycle_state *cycle, int count) {
+    for (int i = 0; i < count; i++) {
+        if (cycle->responses[i].heap) {
+            free(cycle->responses[i].data);
+        }
+    }
+    if (cycle->combined.heap) {
+        free(cycle->combined.data);
+    }
+    if (cycle->row.heap) {
+        free(cycle->row.data);
+    }
+}
 
-        if (strncmp(lower_line, "device:", 7) == 0) {
-            free(*device);
-            *device = strdup(line + 7); // Preserve the case of the device path
-            if (*device == NULL) {
-                perror("Error allocating memory for device");
-                fclose(file);
-                return -1;
-            }
-            trim_whitespace(*device);
-            remove_surrounding_quotes(*device);
-        } else if (strncmp(lower_line, "baud_rate:", 10) == 0) {
-            *baud_rate = atoi(line + 10);
-        } else if (strncmp(lower_line, "commands:", 9) == 0) {
-            in_commands_block = 1; // Start reading commands block
+// Function to hand the complete lines in the receive buffer to the response framer
+// URCs are set aside; the other lines are appended to resp. Returns 1 once a
+// final result code was appended, 0 if more lines are needed and -1 on
+// allocation failure.
+int frame_response(struct modem_device *dev, struct response_buf *resp, struct response_info *info) {
+    const char *line;
+    size_t len;
+
+    while (rx_ring_next_line(&dev->rx, &line, &len)) {
+        if (is_unsolicited(dev, line, len)) {
+            record_urc(dev, line, len, 0); // Not part of the response
             continue;
-        } else if (strncmp(lower_line, "interval:", 9) == 0) {
-            *interval = atoi(line + 9);
-        } else if (strncmp(lower_line, "output_folder:", 14) == 0) {
-            free(*output_folder);
-            *output_folder = strdup(line + 14);
-            if (*output_folder == NULL) {
-                perror("Error allocating memory for output folder");
-                fclose(file);
-                return -1;
-            }
-            trim_whitespace(*output_folder);
-            remove_surrounding_quotes(*output_folder);
         }
+        if (response_append(resp, line, len) != 0) {
+            return -1;
+        }
+        int code = final_result_code(line, len);
+        if (code != 0) {
+            info->complete = 1;
+            info->error = code < 0;
+            return 1;
+        }
+    }
+    return 0;
+}
 
-        if (in_commands_block) {
-            if (line[0] == '}') {
-                break; // End of commands block
-            } else if (line[0] == '{') {
-                continue; // Skip opening brace
-            }
+// Function to read response
+// Reads until a final result code line (OK, ERROR, +CME ERROR, ...) arrives,
+// so echoed commands and multi-line bodies are returned as one response.
+// Lines already waiting in the receive buffer are used first; anything that
+// arrives after the final result code stays buffered for the next command.
+// Sleeps in poll() until data arrives or the deadline expires. Only used
+// before the event loop starts; the loop frames responses as bytes arrive.
+int read_response(struct modem_device *dev, struct response_buf *resp, int timeout_ms, struct response_info *info) {
+    long long deadline = monotonic_ms() + timeout_ms;
+    struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
 
-            // Concatenate lines in the commands block
-            strcat(command_buffer, line);
+    resp->len = 0;
+    if (resp->data != NULL) {
+        resp->data[0] = '\0';
+    }
 
-            // Split commands separated by commas
-            char *cmd = strtok(command_buffer, ",");
-            while (cmd != NULL) {
-                // Trim whitespace around commands
-                trim_whitespace(cmd);
+    info->wakeups = 0;
+    info->complete = 0;
+    info->error = 0;
 
-                // Remove surrounding quotes if present
+    // Loop until we see a final result code or reach the deadline
+    int filled = 0;
+    while (1) {
+        // Hand every complete line to the framer
+        int framed = frame_response(dev, resp, info);
+        if (framed < 0) {
+            return -1;
+        } else if (framed > 0) {
+            return resp->len;
+        } else if (filled) {
+            STAT_ADD(io_stats.partial_reads, 1);
+            filled = 0;
+        }
+
+        long long remaining = deadline - monotonic_ms();
+        if (remaining <= 0) {
+            STAT_ADD(io_stats.timeouts, 1);
+            break; // Deadline reached
+        }
+
+        int ready = poll(&pfd, 1, (int)remaining);
+        STAT_ADD(io_stats.waits, 1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        } else if (ready == 0) {
+            STAT_ADD(io_stats.timeouts, 1);
+            break; // Deadline reached
+        }
+
+        info->wakeups++;
+
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            fprintf(stderr, "Serial port closed or in error state\n");
+            return -1;
+        }
+
+        ssize_t bytes_read = rx_ring_fill(&dev->rx, dev->fd);
+
+        if (bytes_read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                // Spurious wakeup, wait again
+                continue;
+            }
+            perror("read");
+            return -1;
+        } else if (bytes_read == 0) {
+            // No more data available
+            break;
+        }
+        filled = 1;
+    }
+
+    // Timed out: return the partial line received so far along with the rest
+    size_t pending = dev->rx.head - dev->rx.tail;
+    if (pending > 0) {
+        if (response_append(resp, dev->rx.data + dev->rx.tail, pending) != 0) {
+            return -1;
+        }
+        dev->rx.tail = dev->rx.scan = dev->rx.head = 0;
+    }
+    return resp->len;
+}
+
+// Function to request modem property (send AT command and get the response)
+int request_modem_property(struct modem_device *dev, const char *command, struct response_buf *resp, int timeout_ms, struct response_info *info) {
+    long long start = monotonic_ns();
+
+    // Send the AT command
+    if (send_at_command(dev, command) != 0) {
+        return -1;
+    }
+
+    // Read the response
+    dev->pending = command;
+    int result = read_response(dev, resp, timeout_ms, info);
+    dev->pending = NULL;
+    if (result < 0) {
+        return -1;
+    }
+
+    long long end = monotonic_ns();
+    info->rtt_us = (end - start) / 1000;
+    info->sent_ns = realtime_ns(start);
+    info->received_ns = realtime_ns(end);
+
+    if (!info->complete) {
+        fprintf(stderr, "Timed out waiting for a final result code to '%s'\n", command);
+    }
+
+    return 0;
+}
+
+// Function to extract the response prefix of an extended command
+// "AT+CREG?" gives "+CREG" and "AT+QENG=\"servingcell\"" gives "+QENG".
+// Returns 0 on success and -1 if the command is not an extended command.
+int command_prefix(const char *command, char *prefix, size_t max_len) {
+    if (strncasecmp(command, "AT+", 3) != 0) {
+        return -1;
+    }
+
+    size_t len = strcspn(command + 2, "?=;");
+    if (len < 2 || len >= max_len) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        prefix[i] = toupper((unsigned char)command[2 + i]);
+    }
+    prefix[len] = '\0';
+    return 0;
+}
+
+// Function to check whether a command can be part of a compound line
+// Only extended commands whose response lines carry their own prefix can be
+// split back apart; identification commands that answer with bare text cannot.
+int pipeline_compatible(const char *command) {
+    static const char *const unprefixed[] = {
+        "+CGSN", "+GSN", "+CIMI", "+CGMI", "+GMI", "+CGMM", "+GMM", "+CGMR", "+GMR", "+QGMR"
+    };
+    char prefix[32];
+
+    if (command_prefix(command, prefix, sizeof(prefix)) != 0 || strchr(command, ';') != NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(unprefixed) / sizeof(unprefixed[0]); i++) {
+        if (strcmp(prefix, unprefixed[i]) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to group the commands into the lines sent to the modem
+// Returns the number of batches written to batches[].
+// Only commands with the same polling period share a line, so the members of
+// a batch always fall due together.
+int build_command_batches(char *commands[], const int periods[], int count, int pipeline, struct command_batch batches[]) {
+    int batch_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        // Find the batch still accepting commands with this period
+        int open_batch = -1;
+        for (int b = 0; b < batch_count && pipeline; b++) {
+            int member = batches[b].members[0];
+            if (pipeline_compatible(commands[member]) && periods[member] == periods[i]) {
+                open_batch = b;
+            }
+        }
+
+        if (pipeline && pipeline_compatible(commands[i]) && open_batch >= 0) {
+            struct command_batch *batch = &batches[open_batch];
+            size_t used = strlen(batch->line);
+            size_t extra = 1 + strlen(commands[i]) - 2; // ";" plus the command without "AT"
+            char prefix[32];
+            int clash = 0;
+
+            // Two commands answering with the same prefix could not be told apart
+            command_prefix(commands[i], prefix, sizeof(prefix));
+            for (int m = 0; m < batch->count; m++) {
+                char other[32];
+                command_prefix(commands[batch->members[m]], other, sizeof(other));
+                if (strcmp(prefix, other) == 0) {
+                    clash = 1;
+                }
+            }
+
+            if (!clash && batch->count < PIPELINE_MAX_BATCH && used + extra <= PIPELINE_MAX_LINE) {
+                snprintf(batch->line + used, sizeof(batch->line) - used, ";%s", commands[i] + 2);
+                batch->members[batch->count++] = i;
+                continue;
+            }
+        }
+
+        // Start a new batch with this command
+        struct command_batch *batch = &batches[batch_count];
+        batch->members[0] = i;
+        batch->count = 1;
+        snprintf(batch->line, sizeof(batch->line), "%s", commands[i]);
+        batch_count++;
+    }
+
+    return batch_count;
+}
+
+// Function to split the response to a compound line into per-command responses
+// Body lines are assigned by their "+NAME:" prefix (unprefixed continuation lines
+// follow the previous one) and every command gets the final result code.
+// Returns 0 on success and -1 on allocation failure.
+int split_compound_response(const struct command_batch *batch, char *commands[], const struct response_buf *combined, struct response_buf responses[]) {
+    char prefixes[PIPELINE_MAX_BATCH][32];
+    int current = -1; // Member receiving unprefixed lines
+
+    for (int m = 0; m < batch->count; m++) {
+        command_prefix(commands[batch->members[m]], prefixes[m], sizeof(prefixes[m]));
+        responses[batch->members[m]].len = 0;
+    }
+
+    const char *line = combined->data;
+    const char *end = combined->data + combined->len;
+    while (line < end) {
+        const char *nl = memchr(line, '\n', end - line);
+        size_t len = nl ? (size_t)(nl - line) + 1 : (size_t)(end - line);
+
+        size_t text_len = strcspn(line, "\r\n");
+        if (text_len > len) {
+            text_len = len;
+        }
+
+        if (text_len == 0 || strncasecmp(line, "AT", 2) == 0) {
+            // Skip blank lines and the echoed command line
+        } else if (final_result_code(line, len) != 0) {
+            for (int m = 0; m < batch->count; m++) {
+                if (response_append(&responses[batch->members[m]], line, len) != 0) {
+                    return -1;
+                }
+            }
+        } else {
+            for (int m = 0; m < batch->count; m++) {
+                size_t plen = strlen(prefixes[m]);
+                if (text_len > plen && strncasecmp(line, prefixes[m], plen) == 0 && line[plen] == ':') {
+                    current = m;
+                    break;
+                }
+            }
+            if (current >= 0 && response_append(&responses[batch->members[current]], line, len) != 0) {
+                return -1;
+            }
+        }
+
+        line += len;
+    }
+
+    return 0;
+}
+
+// Unsolicited result codes the RM500Q can send (3GPP TS 27.007 and Quectel)
+static const char *const urc_prefixes[] = {
+    "+CREG", "+CGREG", "+CEREG", "+C5GREG", "+QIND", "+CPIN", "+QUSIM", "+CMTI",
+    "+CGEV", "+QNETDEVSTATUS", "+QSTATE", "RING", "RDY", "POWERED DOWN",
+};
+
+// Function to tell whether a received line is an unsolicited result code
+// A line whose prefix belongs to the pending command (e.g. +CREG while
+// AT+CREG? is waiting) is taken as part of the response.
+int is_unsolicited(const struct modem_device *dev, const char *line, size_t len) {
+    size_t text_len = strcspn(line, "\r\n");
+    if (text_len > len) {
+        text_len = len;
+    }
+
+    for (size_t p = 0; p < sizeof(urc_prefixes) / sizeof(urc_prefixes[0]); p++) {
+        const char *prefix = urc_prefixes[p];
+        size_t plen = strlen(prefix);
+        if (text_len < plen || strncasecmp(line, prefix, plen) != 0) {
+            continue;
+        }
+
+        if (prefix[0] == '+') {
+            if (text_len == plen || line[plen] != ':') {
+                continue; // e.g. +CREG must not match +CREGX
+            }
+            if (dev->pending != NULL && strcasestr(dev->pending, prefix) != NULL) {
+                return 0;
+            }
+        } else if (text_len != plen) {
+            continue; // Bare words must be the whole line
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Function to keep a URC with its arrival time until the next cycle is recorded
+// Stray lines are kept the same way, flagged, so a late reply still reaches the data file.
+void record_urc(struct modem_device *dev, const char *line, size_t len, int stray) {
+    if (!stray) {
+        dev->urcs_seen++;
+    }
+    if (!dev->record_urcs) {
+        return;
+    }
+    if (dev->urc_count == URC_MAX_PER_CYCLE) {
+        dev->urcs_dropped++;
+        return;
+    }
+
+    size_t text_len = strcspn(line, "\r\n");
+    if (text_len > len) {
+        text_len = len;
+    }
+    if (text_len >= URC_TEXT_MAX) {
+        text_len = URC_TEXT_MAX - 1;
+    }
+
+    struct urc_event *event = &dev->urcs[dev->urc_count++];
+    event->timestamp_ns = realtime_ns(monotonic_ns());
+    event->stray = stray;
+    memcpy(event->text, line, text_len);
+    event->text[text_len] = '\0';
+}
+
+// Function to take the URCs out of what arrived while no command was pending
+// Complete URC lines are recorded; other non-blank lines (a response that came
+// after its deadline, noise) are recorded and counted as stray. Returns the
+// number of URCs found.
+int scan_unsolicited(struct modem_device *dev) {
+    const char *line;
+    size_t len;
+    int found = 0;
+
+    while (rx_ring_next_line(&dev->rx, &line, &len)) {
+        if (is_unsolicited(dev, line, len)) {
+            record_urc(dev, line, len, 0);
+            found++;
+        } else if (strspn(line, "\r\n") < len) {
+            record_urc(dev, line, len, 1);
+            dev->stray_bytes += len;
+            dev->cycle_stray += len;
+            dev->stray_lines++;
+            STAT_ADD(io_stats.stray_lines, 1);
+        }
+    }
+    return found;
+}
+
+// Function to record URCs received between cycles right away
+// They go out as a row (or records) of their own, with no command sampled.
+void process_unsolicited(struct event_loop *loop, struct modem_device *dev) {
+    struct cycle_state *cycle = &dev->cycle;
+    if (dev->urc_count == 0) {
+        return;
+    }
+
+    memset(cycle->due, 0, loop->count);
+    memset(cycle->infos, 0, loop->count * sizeof(cycle->infos[0]));
+    cycle->timestamp_ns = realtime_ns(monotonic_ns());
+    format_timestamp(&cycle->stamp_cache, cycle->timestamp_ns, cycle->timestamp);
+    take_urcs(dev, cycle);
+
+    if (loop->console->mode == CONSOLE_VERBOSE) {
+        if (loop->device_count > 1) {
+            printf("Device: %s\n", dev->label);
+        }
+        printf("Timestamp: %s\n", cycle->timestamp);
+        for (int u = 0; u < cycle->urc_count; u++) {
+            printf("%s: %s\n\n", cycle->urcs[u].stray ? "Stray" : "URC", cycle->urcs[u].text);
+        }
+    }
+    sample_queue_push(loop->queue, dev->index, cycle);
+}
+
+// Function to move the pending URCs of the device into a cycle
+void take_urcs(struct modem_device *dev, struct cycle_state *cycle) {
+    memcpy(cycle->urcs, dev->urcs, dev->urc_count * sizeof(dev->urcs[0]));
+    cycle->urc_count = dev->urc_count;
+    dev->urc_count = 0;
+}
+
+// Function to enable the URCs the monitor records
+// Registration reports with location (n=2) for every RAT and all Quectel
+// indications. Failures are reported but not fatal: older firmware lacks some.
+int subscribe_urcs(struct modem_device *dev, struct response_buf *resp, int timeout_ms) {
+    static const char *const subscriptions[] = {
+        "AT+CREG=2", "AT+CGREG=2", "AT+CEREG=2", "AT+C5GREG=2", "AT+QINDCFG=\"all\",1",
+    };
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(subscriptions) / sizeof(subscriptions[0]); i++) {
+        struct response_info info;
+        flush_serial_port(dev);
+        if (request_modem_property(dev, subscriptions[i], resp, timeout_ms, &info) != 0 || !info.complete || info.error) {
+            fprintf(stderr, "Could not enable URCs with '%s'\n", subscriptions[i]);
+            failed++;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+// Function to move the commands of a compound line that failed on their own
+// into batches of their own, so a single unsupported command does not cost an
+// extra round trip on every cycle
+// A command is only ever isolated from a compound line, and the result is a
+// batch of one, so batches[] never holds more than twice the command count.
+// The device merges them back after PIPELINE_REMERGE_CYCLES clean cycles.
+void isolate_failed_commands(struct command_batch batches[], int *batch_count, int b, char *commands[], const struct response_info infos[]) {
+    struct command_batch *batch = &batches[b];
+    int kept = 0;
+
+    batch->line[0] = '\0';
+    for (int m = 0; m < batch->count; m++) {
+        int i = batch->members[m];
+        size_t used = strlen(batch->line);
+
+        if (infos[i].complete && !infos[i].error) {
+            // Still compatible: rebuild the compound line around it
+            if (kept == 0) {
+                snprintf(batch->line, sizeof(batch->line), "%s", commands[i]);
+            } else {
+                snprintf(batch->line + used, sizeof(batch->line) - used, ";%s", commands[i] + 2);
+            }
+            batch->members[kept++] = i;
+        } else {
+            struct command_batch *single = &batches[(*batch_count)++];
+            single->members[0] = i;
+            single->count = 1;
+            snprintf(single->line, sizeof(single->line), "%s", commands[i]);
+        }
+    }
+    batch->count = kept;
+}
+
+// Function to open a device and set up its polling state
+// The label is the last component of the path, e.g. ttyUSB3.
+int device_open(struct modem_device *dev, int index, const char *path, int baud_rate, struct arena *arena, int count) {
+    memset(dev, 0, sizeof(*dev));
+    dev->index = index;
+    dev->path = (char *)path;
+    dev->pending = NULL;
+    dev->state = DEVICE_IDLE;
+    dev->fallback = -1;
+    const char *slash = strrchr(path, '/');
+    snprintf(dev->label, sizeof(dev->label), "%s", slash ? slash + 1 : path);
+
+    dev->batches = arena_alloc(arena, 2 * (size_t)(count ? count : 1) * sizeof(dev->batches[0]));
+    dev->built_batches = arena_alloc(arena, (size_t)(count ? count : 1) * sizeof(dev->batches[0]));
+    dev->next_due = arena_alloc(arena, count ? count : 1);
+    if (dev->batches == NULL || dev->built_batches == NULL || dev->next_due == NULL ||
+        cycle_state_init(&dev->cycle, arena, count) != 0) {
+        dev->fd = -1;
+        return -1;
+    }
+
+    dev->fd = open(path, O_RDWR | O_NOCTTY | O_NDELAY);
+    if (dev->fd == -1) {
+        fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Configure the serial port and allocate the receive buffer
+    if (configure_serial_port(dev->fd, baud_rate) != 0 || rx_ring_init(&dev->rx, RX_RING_SIZE) != 0) {
+        close(dev->fd);
+        dev->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to close a device and release its buffers
+void device_close(struct modem_device *dev, int count) {
+    if (dev->fd >= 0) {
+        close(dev->fd);
+        dev->fd = -1;
+    }
+    rx_ring_free(&dev->rx);
+    if (dev->cycle.responses != NULL) {
+        cycle_state_free(&dev->cycle, count);
+    }
+}
+
+// Function to add a device to the end of the list of pending requests
+static void waiting_append(struct event_loop *loop, struct modem_device *dev) {
+    dev->next_waiting = NULL;
+    dev->prev_waiting = loop->waiting_tail;
+    if (loop->waiting_tail != NULL) {
+        loop->waiting_tail->next_waiting = dev;
+    } else {
+        loop->waiting_head = dev;
+    }
+    loop->waiting_tail = dev;
+}
+
+// Function to take a device out of the list of pending requests
+// Every request gets the same timeout, so the list stays in deadline order.
+void waiting_remove(struct event_loop *loop, struct modem_device *dev) {
+    if (dev->prev_waiting != NULL) {
+        dev->prev_waiting->next_waiting = dev->next_waiting;
+    } else if (loop->waiting_head == dev) {
+        loop->waiting_head = dev->next_waiting;
+    }
+    if (dev->next_waiting != NULL) {
+        dev->next_waiting->prev_waiting = dev->prev_waiting;
+    } else if (loop->waiting_tail == dev) {
+        loop->waiting_tail = dev->prev_waiting;
+    }
+    dev->prev_waiting = dev->next_waiting = NULL;
+}
+
+// Function to start a cycle on a device
+// The row is stamped with the tick that made the commands due, shared by
+// every device sampled on that tick.
+void device_start_cycle(struct event_loop *loop, struct modem_device *dev, const unsigned char due[], long long tick_mono_ns) {
+    struct cycle_state *cycle = &dev->cycle;
+
+    memcpy(cycle->due, due, loop->count);
+    memset(cycle->infos, 0, loop->count * sizeof(cycle->infos[0]));
+    dev->tick_mono_ns = tick_mono_ns;
+    cycle->timestamp_ns = realtime_ns(tick_mono_ns);
+    format_timestamp(&cycle->stamp_cache, cycle->timestamp_ns, cycle->timestamp);
+
+    dev->batch = 0;
+    dev->batch_end = dev->batch_count; // Batches split off during the cycle wait for the next one
+    dev->fallback = -1;
+    dev->cycle_failed = 0;
+    dev->drained = 0;
+    dev->cycle_start_us = monotonic_us();
+    dev->state = DEVICE_POLLING;
+}
+
+// Function to send the next command line of a device's cycle
+// Runs until the device waits for a response or the cycle is finished;
+// responses already in the receive buffer are used without waiting.
+void device_advance(struct event_loop *loop, struct modem_device *dev) {
+    while (dev->state == DEVICE_POLLING && dev->pending == NULL) {
+        if (dev->batch == dev->batch_end) {
+            device_finish_cycle(loop, dev); // May start the next cycle
+            continue;
+        }
+
+        struct command_batch *batch = &dev->batches[dev->batch];
+        struct cycle_state *cycle = &dev->cycle;
+        int failed;
+        if (dev->fallback >= 0) {
+            // One failing command aborts the rest of a compound line, so its
+            // members are sent one at a time for this cycle
+            int i = batch->members[dev->fallback];
+            failed = device_send(loop, dev, loop->commands[i], &cycle->responses[i], &cycle->infos[i], 1);
+        } else if (batch->count == 0 || !cycle->due[batch->members[0]]) {
+            dev->batch++; // Emptied by isolate_failed_commands() or not scheduled on this tick
+            continue;
+        } else if (batch->count > 1) {
+            // Compound lines are kept in step by the response framer, so they
+            // only drain before the first line sent in the cycle (batch 0 may
+            // not be due on this tick)
+            failed = device_send(loop, dev, batch->line, &cycle->combined, &dev->compound_info, !dev->drained);
+        } else {
+            int i = batch->members[0];
+            failed = device_send(loop, dev, loop->commands[i], &cycle->responses[i], &cycle->infos[i], 1);
+        }
+
+        if (!failed) {
+            int framed = frame_response(dev, dev->target, dev->target_info);
+            if (framed == 0) {
+                return; // Wait for the event loop
+            }
+            failed = framed < 0;
+        }
+        device_request_done(loop, dev, failed);
+    }
+}
+
+// Function to send a command line without waiting for its response
+// Returns 0 once sent, -1 if the port rejected it.
+int device_send(struct event_loop *loop, struct modem_device *dev, const char *line, struct response_buf *resp, struct response_info *info, int flush) {
+    // Drain the serial port before sending a new command
+    if (flush) {
+        flush_serial_port(dev);
+        dev->drained = 1;
+    }
+
+    resp->len = 0;
+    resp->data[0] = '\0';
+    memset(info, 0, sizeof(*info));
+    dev->target = resp;
+    dev->target_info = info;
+    dev->sent_mono_ns = monotonic_ns();
+
+    if (send_at_command(dev, line) != 0) {
+        return -1;
+    }
+
+    dev->pending = line;
+    dev->deadline_ns = dev->sent_mono_ns + (long long)loop->timeout_ms * 1000000LL;
+    waiting_append(loop, dev);
+    return 0;
+}
+
+// Function to account for the end of a request and move to the next one
+// failed is set if the line could not be sent or its response not stored.
+void device_request_done(struct event_loop *loop, struct modem_device *dev, int failed) {
+    struct command_batch *batch = &dev->batches[dev->batch];
+    struct response_info *info = dev->target_info;
+    const char *line = dev->pending;
+
+    if (dev->pending != NULL) {
+        waiting_remove(loop, dev);
+        dev->pending = NULL;
+    }
+
+    if (!failed) {
+        long long end = monotonic_ns();
+        info->rtt_us = (end - dev->sent_mono_ns) / 1000;
+        info->sent_ns = realtime_ns(dev->sent_mono_ns);
+        info->received_ns = realtime_ns(end);
+        if (!info->complete) {
+            fprintf(stderr, "Timed out waiting for a final result code to '%s'\n", line);
+        }
+    }
+    if (failed || !info->complete || info->error) {
+        dev->cycle_failed = 1;
+    }
+
+    if (dev->fallback < 0 && batch->count > 1) {
+        if (!failed && info->complete && !info->error &&
+            split_compound_response(batch, loop->commands, &dev->cycle.combined, dev->cycle.responses) == 0) {
+            for (int m = 0; m < batch->count; m++) {
+                dev->cycle.infos[batch->members[m]] = *info;
+            }
+            dev->batch++;
+        } else {
+            fprintf(stderr, "Compound command '%s' failed, sending its commands separately\n", batch->line);
+            dev->fallback = 0;
+        }
+        return;
+    }
+
+    if (failed) {
+        int i = batch->members[dev->fallback >= 0 ? dev->fallback : 0];
+        fprintf(stderr, "Error processing command '%s'\n", loop->commands[i]);
+        dev->cycle.responses[i].len = 0;
+        response_append(&dev->cycle.responses[i], "ERROR", 5); // Indicate an error
+    }
+
+    if (dev->fallback >= 0 && ++dev->fallback < batch->count) {
+        return; // Next member of the failed compound line
+    }
+    if (dev->fallback >= 0) {
+        isolate_failed_commands(dev->batches, &dev->batch_count, dev->batch, loop->commands, dev->cycle.infos);
+        dev->fallback = -1;
+    }
+    dev->batch++;
+}
+
+// Function to hand a finished cycle to the console and the writer thread
+// A tick that came while the cycle was running starts the next one right away.
+void device_finish_cycle(struct event_loop *loop, struct modem_device *dev) {
+    struct cycle_state *cycle = &dev->cycle;
+    char **commands = loop->commands;
+
+    // URCs that arrived during the cycle are recorded with it
+    take_urcs(dev, cycle);
+
+    // Print each response
+    if (loop->console->mode == CONSOLE_VERBOSE) {
+        if (loop->device_count > 1) {
+            printf("Device: %s\n", dev->label);
+        }
+        printf("Timestamp: %s\n", cycle->timestamp);
+        for (int i = 0; i < loop->count; i++) {
+            if (cycle->due[i]) {
+                printf("Command: %s\nResponse: %s\nWakeups: %u\n\n", commands[i], cycle->responses[i].data, cycle->infos[i].wakeups);
+            }
+        }
+        for (int u = 0; u < cycle->urc_count; u++) {
+            printf("%s: %s\n\n", cycle->urcs[u].stray ? "Stray" : "URC", cycle->urcs[u].text);
+        }
+    } else if (loop->console->mode == CONSOLE_DASHBOARD) {
+        dashboard_update(loop->console, loop->devices, commands, loop->count, dev->index);
+    }
+
+    if (loop->metrics != NULL) {
+        metrics_record_cycle(loop->metrics, dev);
+    }
+    io_histogram_add(&io_stats.stray_per_cycle, dev->cycle_stray);
+    dev->cycle_stray = 0;
+
+    // A timeout may have been transient: give isolated commands another try
+    // in their compound lines once the device has been clean for a while
+    if (dev->batch_count > dev->built_count) {
+        dev->clean_cycles = dev->cycle_failed ? 0 : dev->clean_cycles + 1;
+        if (dev->clean_cycles >= PIPELINE_REMERGE_CYCLES) {
+            memcpy(dev->batches, dev->built_batches, dev->built_count * sizeof(dev->batches[0]));
+            dev->batch_count = dev->built_count;
+            dev->clean_cycles = 0;
+        }
+    }
+
+    // Hand the cycle to the writer thread; this never blocks on the disk
+    sample_queue_push(loop->queue, dev->index, cycle);
+    dev->state = DEVICE_IDLE;
+    dev->cycles++;
+
+    // Latency counts from the tick, so time spent waiting behind an overrun is included
+    histogram_add(&loop->cycle_latency, (monotonic_ns() - dev->tick_mono_ns) / 1000);
+    for (int i = 0; i < loop->count; i++) {
+        loop->samples += cycle->due[i];
+    }
+
+    if (loop->bench != NULL) {
+        bench_record(loop->bench, cycle->infos, monotonic_us() - dev->cycle_start_us);
+        if (loop->bench_started < loop->bench->max_cycles) {
+            loop->bench_started++;
+            device_start_cycle(loop, dev, loop->due, monotonic_ns());
+        }
+    } else if (dev->missed) {
+        dev->missed = 0;
+        device_start_cycle(loop, dev, dev->next_due, dev->next_tick_ns);
+    }
+}
+
+// Function to read what a device sent
+// While a request is pending the bytes go to the response framer; otherwise
+// only URCs are expected.
+void device_readable(struct event_loop *loop, struct modem_device *dev) {
+    if (dev->state == DEVICE_OFFLINE) {
+        return;
+    }
+
+    ssize_t n = rx_ring_fill(&dev->rx, dev->fd);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return; // Spurious wakeup
+    } else if (n <= 0) {
+        device_offline(loop, dev);
+        return;
+    }
+    dev->rx_bytes += n;
+
+    if (dev->pending == NULL) {
+        scan_unsolicited(dev);
+        process_unsolicited(loop, dev);
+        return;
+    }
+
+    dev->target_info->wakeups++;
+    int framed = frame_response(dev, dev->target, dev->target_info);
+    if (framed != 0) {
+        device_request_done(loop, dev, framed < 0);
+        device_advance(loop, dev);
+    } else {
+        STAT_ADD(io_stats.partial_reads, 1);
+    }
+}
+
+// Function to give up on a response whose deadline has passed
+// The partial line received so far is kept with the rest of the response.
+void device_timeout(struct event_loop *loop, struct modem_device *dev) {
+    size_t pending = dev->rx.head - dev->rx.tail;
+    int failed = 0;
+
+    dev->timeouts++;
+    STAT_ADD(io_stats.timeouts, 1);
+    if (pending > 0) {
+        failed = response_append(dev->target, dev->rx.data + dev->rx.tail, pending) != 0;
+        dev->rx.tail = dev->rx.scan = dev->rx.head = 0;
+    }
+    device_request_done(loop, dev, failed);
+    device_advance(loop, dev);
+}
+
+// Function to stop polling a device whose port failed
+// The cycle in progress is dropped; the other devices carry on.
+void device_offline(struct event_loop *loop, struct modem_device *dev) {
+    fprintf(stderr, "Serial port '%s' closed or in error state, no longer polled\n", dev->path);
+    if (dev->pending != NULL) {
+        waiting_remove(loop, dev);
+        dev->pending = NULL;
+    }
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, dev->fd, NULL);
+    dev->state = DEVICE_OFFLINE;
+    loop->online--;
+}
+
+// Function to register every device and the scheduler timer with epoll
+int event_loop_init(struct event_loop *loop, struct modem_device *devices, int device_count, struct scheduler *sched, struct arena *arena, char *commands[], int count, int timeout_ms, struct sample_queue *queue, struct console *console) {
+    memset(loop, 0, sizeof(*loop));
+    loop->devices = devices;
+    loop->device_count = device_count;
+    loop->online = device_count;
+    loop->sched = sched;
+    loop->commands = commands;
+    loop->count = count;
+    loop->timeout_ms = timeout_ms;
+    loop->queue = queue;
+    loop->console = console;
+    loop->epoll_fd = -1;
+    loop->timer_fd = -1;
+
+    loop->due = arena_alloc(arena, count ? count : 1);
+    if (loop->due == NULL) {
+        return -1;
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timer_fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_TIMER };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event) != 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    for (int d = 0; d < device_count; d++) {
+        event.data.u64 = d;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, devices[d].fd, &event) != 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to run the event loop until shutdown, or until --bench is done
+// Every wakeup handles the ready descriptors, then expires the responses
+// whose deadline has passed.
+int event_loop_run(struct event_loop *loop) {
+    struct epoll_event events[EPOLL_BATCH];
+
+    loop->start_ns = loop->end_ns = monotonic_ns();
+    if (loop->count == 0) {
+        return 0; // Nothing to poll
+    }
+
+    if (loop->bench != NULL) {
+        // Every command on every cycle, each device starting its next cycle at once
+        memset(loop->due, 1, loop->count);
+        for (int d = 0; d < loop->device_count && loop->bench_started < loop->bench->max_cycles; d++) {
+            loop->bench_started++;
+            device_start_cycle(loop, &loop->devices[d], loop->due, loop->start_ns);
+            device_advance(loop, &loop->devices[d]);
+        }
+    } else {
+        // The first tick is now: opening many ports can take longer than a period,
+        // and those ticks are not missed
+        for (int i = 0; i < loop->sched->count; i++) {
+            loop->sched->next[i].tv_sec = loop->start_ns / 1000000000LL;
+            loop->sched->next[i].tv_nsec = loop->start_ns % 1000000000LL;
+        }
+        if (scheduler_arm(loop->sched, loop->timer_fd) != 0) {
+            return -1;
+        }
+    }
+
+    long long stop_ns = loop->duration_ns > 0 ? loop->start_ns + loop->duration_ns : 0;
+    while (running && loop->online > 0 &&
+           (loop->bench == NULL || loop->bench->cycles < loop->bench->max_cycles)) {
+        long long wake_ns = loop->waiting_head != NULL ? loop->waiting_head->deadline_ns : 0;
+        if (stop_ns > 0 && (wake_ns == 0 || stop_ns < wake_ns)) {
+            wake_ns = stop_ns;
+        }
+        int timeout = -1;
+        if (wake_ns > 0) {
+            long long left = wake_ns - monotonic_ns();
+            timeout = left > 0 ? (int)((left + 999999) / 1000000) : 0;
+        }
+
+        int n = epoll_wait(loop->epoll_fd, events, EPOLL_BATCH, timeout);
+        STAT_ADD(io_stats.waits, 1);
+        if (dump_requested) {
+            dump_requested = 0;
+            io_stats_dump(stderr);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return -1;
+        }
+        loop->wakeups++;
+
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.u64 == EVENT_TIMER) {
+                event_loop_tick(loop);
+            } else if (events[e].data.u64 >= EVENT_METRICS) {
+                metrics_event(loop->metrics, events[e].data.u64 - EVENT_METRICS);
+            } else {
+                device_readable(loop, &loop->devices[events[e].data.u64]);
+            }
+        }
+
+        // Responses are expired oldest first
+        long long now = monotonic_ns();
+        while (loop->waiting_head != NULL && loop->waiting_head->deadline_ns <= now) {
+            device_timeout(loop, loop->waiting_head);
+        }
+        if (stop_ns > 0 && now >= stop_ns) {
+            break;
+        }
+    }
+    loop->end_ns = monotonic_ns();
+    return 0;
+}
+
+// Function to start the cycles of a scheduler tick on every device
+// A device still busy with the previous tick runs the new one as soon as it
+// is done, or with skip_missed drops it.
+void event_loop_tick(struct event_loop *loop) {
+    uint64_t expirations;
+    if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("read timer");
+    }
+
+    scheduler_collect(loop->sched, loop->due);
+    long long tick_ns = monotonic_ns();
+
+    for (int d = 0; d < loop->device_count; d++) {
+        struct modem_device *dev = &loop->devices[d];
+        if (dev->state == DEVICE_IDLE) {
+            device_start_cycle(loop, dev, loop->due, tick_ns);
+            device_advance(loop, dev);
+        } else if (dev->state == DEVICE_POLLING) {
+            dev->overruns++;
+            if (loop->sched->skip_missed) {
+                dev->skipped++;
+                continue;
+            }
+            if (!dev->missed) {
+                memset(dev->next_due, 0, loop->count);
+                dev->next_tick_ns = tick_ns;
+                dev->missed = 1;
+            }
+            for (int i = 0; i < loop->count; i++) {
+                dev->next_due[i] |= loop->due[i];
+            }
+        }
+    }
+
+    scheduler_advance(loop->sched, loop->due, loop->console->mode == CONSOLE_VERBOSE);
+    scheduler_arm(loop->sched, loop->timer_fd);
+}
+
+// Function to close the epoll set and the timer
+void event_loop_close(struct event_loop *loop) {
+    if (loop->timer_fd >= 0) {
+        close(loop->timer_fd);
+    }
+    if (loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+    }
+}
+
+// Upper bounds of the command latency buckets
+static const long long metrics_latency_bounds_us[METRICS_LATENCY_BUCKETS] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000
+};
+
+// Function to add a series to the metrics text, its name and labels formatted now
+static int metrics_add(struct metrics_server *m, int kind, const void *value, const char *format, ...) {
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len < 0 || len >= (int)sizeof(text)) {
+        fprintf(stderr, "Metric name too long: %s\n", text);
+        return -1;
+    }
+
+    if (m->names_len + len > m->names_cap) {
+        size_t cap = m->names_cap ? m->names_cap * 2 : 16384;
+        while (cap < m->names_len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(m->names, cap);
+        if (grown == NULL) {
+            perror("Error allocating memory for metrics");
+            return -1;
+        }
+        m->names = grown;
+        m->names_cap = cap;
+    }
+    if (m->series_count == m->series_cap) {
+        int cap = m->series_cap ? m->series_cap * 2 : 256;
+        struct metrics_series *grown = realloc(m->series, cap * sizeof(m->series[0]));
+        if (grown == NULL) {
+            perror("Error allocating memory for metrics");
+            return -1;
+        }
+        m->series = grown;
+        m->series_cap = cap;
+    }
+
+    struct metrics_series *series = &m->series[m->series_count++];
+    series->name = m->names_len;
+    series->name_len = len;
+    series->kind = kind;
+    series->value = value;
+    memcpy(m->names + m->names_len, text, len);
+    m->names_len += len;
+    return 0;
+}
+
+// Function to escape a label value (backslash, quote, newline)
+static void metrics_escape(const char *text, char *out, size_t max_len) {
+    size_t len = 0;
+    for (; *text && len + 3 < max_len; text++) {
+        if (*text == '\\' || *text == '"') {
+            out[len++] = '\\';
+            out[len++] = *text;
+        } else if (*text == '\n') {
+            out[len++] = '\\';
+            out[len++] = 'n';
+        } else {
+            out[len++] = *text;
+        }
+    }
+    out[len] = '\0';
+}
+
+// Function to add a HELP and TYPE line and one series per device
+static int metrics_add_device_family(struct metrics_server *m, struct event_loop *loop, const char *name, const char *type,
+                                     const char *help, int kind, size_t field_offset) {
+    if (metrics_add(m, METRIC_TEXT, NULL, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type) != 0) {
+        return -1;
+    }
+    for (int d = 0; d < loop->device_count; d++) {
+        char label[2 * MODEM_SHM_NAME_LEN];
+        metrics_escape(loop->devices[d].label, label, sizeof(label));
+        if (metrics_add(m, kind, (const char *)&loop->devices[d] + field_offset, "%s{device=\"%s\"} ", name, label) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to start the metrics endpoint on 127.0.0.1:port
+// Every series is laid out here, so a scrape never formats a name.
+int metrics_open(struct metrics_server *m, struct event_loop *loop, int port) {
+    memset(m, 0, sizeof(*m));
+    m->listen_fd = -1;
+    m->epoll_fd = loop->epoll_fd;
+    for (int c = 0; c < METRICS_MAX_CLIENTS; c++) {
+        m->clients[c].fd = -1;
+    }
+
+    // Parsed values, as in the typed CSV columns
+    m->count = loop->count;
+    m->parsers = calloc(loop->count ? loop->count : 1, sizeof(m->parsers[0]));
+    m->first_field = calloc(loop->count ? loop->count : 1, sizeof(m->first_field[0]));
+    m->latency = calloc(loop->count ? loop->count : 1, sizeof(m->latency[0]));
+    if (m->parsers == NULL || m->first_field == NULL || m->latency == NULL) {
+        perror("Error allocating memory for metrics");
+        metrics_close(m);
+        return -1;
+    }
+    for (int i = 0; i < loop->count; i++) {
+        m->parsers[i] = find_response_parser(loop->commands[i]);
+        m->first_field[i] = m->field_count;
+        m->field_count += m->parsers[i] ? m->parsers[i]->field_count : 0;
+    }
+    m->values = malloc((size_t)loop->device_count * (m->field_count ? m->field_count : 1) * sizeof(int32_t));
+    if (m->values == NULL) {
+        perror("Error allocating memory for metrics");
+        metrics_close(m);
+        return -1;
+    }
+    for (size_t v = 0; v < (size_t)loop->device_count * m->field_count; v++) {
+        m->values[v] = FIELD_MISSING;
+    }
+
+    // Device counters
+    int failed =
+        metrics_add_device_family(m, loop, "modem_up", "gauge", "1 while the modem is polled, 0 once its port failed.",
+                                  METRIC_UP, offsetof(struct modem_device, state)) ||
+        metrics_add_device_family(m, loop, "modem_cycles_total", "counter", "Polling cycles completed.",
+                                  METRIC_ULONG, offsetof(struct modem_device, cycles)) ||
+        metrics_add_device_family(m, loop, "modem_overruns_total", "counter", "Ticks that found the previous cycle still running.",
+                                  METRIC_ULONG, offsetof(struct modem_device, overruns)) ||
+        metrics_add_device_family(m, loop, "modem_response_timeouts_total", "counter", "Responses given up on at their deadline.",
+                                  METRIC_ULONG, offsetof(struct modem_device, timeouts)) ||
+        metrics_add_device_family(m, loop, "modem_rx_bytes_total", "counter", "Bytes read from the serial port.",
+                                  METRIC_ULLONG, offsetof(struct modem_device, rx_bytes)) ||
+        metrics_add_device_family(m, loop, "modem_tx_bytes_total", "counter", "Bytes written to the serial port.",
+                                  METRIC_ULLONG, offsetof(struct modem_device, tx_bytes)) ||
+        metrics_add_device_family(m, loop, "modem_urcs_total", "counter", "Unsolicited result codes received.",
+                                  METRIC_ULONG, offsetof(struct modem_device, urcs_seen)) ||
+        metrics_add_device_family(m, loop, "modem_stray_bytes_total", "counter", "Bytes received outside a response that are not URCs.",
+                                  METRIC_ULLONG, offsetof(struct modem_device, stray_bytes)) ||
+        metrics_add_device_family(m, loop, "modem_stray_lines_total", "counter", "Lines received outside a response that are not URCs.",
+                                  METRIC_ULONG, offsetof(struct modem_device, stray_lines));
+
+    // Latest parsed values
+    failed = failed || metrics_add(m, METRIC_TEXT, NULL, "# HELP modem_value Latest value parsed from a response, NaN if missing.\n"
+                                                          "# TYPE modem_value gauge\n");
+    for (int d = 0; !failed && d < loop->device_count; d++) {
+        char label[2 * MODEM_SHM_NAME_LEN];
+        metrics_escape(loop->devices[d].label, label, sizeof(label));
+        for (int i = 0; !failed && i < loop->count; i++) {
+            char command[256];
+            metrics_escape(loop->commands[i], command, sizeof(command));
+            for (int f = 0; !failed && m->parsers[i] != NULL && f < m->parsers[i]->field_count; f++) {
+                failed = metrics_add(m, METRIC_INT32, &m->values[(size_t)d * m->field_count + m->first_field[i] + f],
+                                     "modem_value{device=\"%s\",command=\"%s\",field=\"%s\"} ",
+                                     label, command, m->parsers[i]->fields[f]);
+            }
+        }
+    }
+
+    // Command round-trip times of all devices
+    failed = failed || metrics_add(m, METRIC_TEXT, NULL, "# HELP modem_command_latency_seconds Time from sending a command to its final result code.\n"
+                                                          "# TYPE modem_command_latency_seconds histogram\n");
+    for (int i = 0; !failed && i < loop->count; i++) {
+        char command[256];
+        metrics_escape(loop->commands[i], command, sizeof(command));
+        for (int b = 0; !failed && b < METRICS_LATENCY_BUCKETS; b++) {
+            failed = metrics_add(m, METRIC_ULONG, &m->latency[i].buckets[b],
+                                 "modem_command_latency_seconds_bucket{command=\"%s\",le=\"%g\"} ",
+                                 command, metrics_latency_bounds_us[b] / 1e6);
+        }
+        failed = failed ||
+            metrics_add(m, METRIC_ULONG, &m->latency[i].count, "modem_command_latency_seconds_bucket{command=\"%s\",le=\"+Inf\"} ", command) ||
+            metrics_add(m, METRIC_MICROS, &m->latency[i].sum_us, "modem_command_latency_seconds_sum{command=\"%s\"} ", command) ||
+            metrics_add(m, METRIC_ULONG, &m->latency[i].count, "modem_command_latency_seconds_count{command=\"%s\"} ", command);
+    }
+
+    // Process-wide counters
+    failed = failed ||
+        metrics_add(m, METRIC_TEXT, NULL, "# HELP modem_sample_queue_dropped_total Cycles lost because the writer thread fell behind.\n"
+                                          "# TYPE modem_sample_queue_dropped_total counter\n") ||
+        metrics_add(m, METRIC_ULONG, &loop->queue->dropped, "modem_sample_queue_dropped_total ") ||
+        metrics_add(m, METRIC_TEXT, NULL, "# HELP modem_sample_queue_long_responses_total Responses too long for a queue slot, carried in its spill buffer.\n"
+                                          "# TYPE modem_sample_queue_long_responses_total counter\n") ||
+        metrics_add(m, METRIC_ULONG, &loop->queue->spilled, "modem_sample_queue_long_responses_total ") ||
+        metrics_add(m, METRIC_TEXT, NULL, "# HELP modem_sample_queue_truncated_total Responses cut and recorded as failed because no memory was left for them.\n"
+                                          "# TYPE modem_sample_queue_truncated_total counter\n") ||
+        metrics_add(m, METRIC_ULONG, &loop->queue->truncated, "modem_sample_queue_truncated_total ") ||
+        metrics_add(m, METRIC_TEXT, NULL, "# HELP modem_schedule_overruns_total Cycles that finished after a command's next deadline.\n"
+                                          "# TYPE modem_schedule_overruns_total counter\n") ||
+        metrics_add(m, METRIC_ULONG, &loop->sched->overruns, "modem_schedule_overruns_total ") ||
+        metrics_add(m, METRIC_TEXT, NULL, "# HELP modem_schedule_max_lateness_seconds Worst lateness of an overrun.\n"
+                                          "# TYPE modem_schedule_max_lateness_seconds gauge\n") ||
+        metrics_add(m, METRIC_MICROS, &loop->sched->max_late_us, "modem_schedule_max_lateness_seconds ") ||
+        metrics_add(m, METRIC_TEXT, NULL, "# HELP modem_metrics_scrapes_total Scrapes of this endpoint.\n"
+                                          "# TYPE modem_metrics_scrapes_total counter\n") ||
+        metrics_add(m, METRIC_ULONG, &m->scrapes, "modem_metrics_scrapes_total ");
+    if (failed) {
+        metrics_close(m);
+        return -1;
+    }
+
+    // Every scrape fits its client's buffer: header, names and at most 32 bytes per value
+    m->response_max = 256 + m->names_len + (size_t)m->series_count * 32;
+    for (int c = 0; c < METRICS_MAX_CLIENTS; c++) {
+        m->clients[c].response = malloc(m->response_max);
+        if (m->clients[c].response == NULL) {
+            perror("Error allocating memory for metrics");
+            metrics_close(m);
+            return -1;
+        }
+    }
+
+    // Loopback only: the values are not meant for the network
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int reuse = 1;
+    m->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m->listen_fd < 0 ||
+        setsockopt(m->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(m->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(m->listen_fd, 16) != 0) {
+        perror("Error opening metrics port");
+        metrics_close(m);
+        return -1;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_METRICS };
+    if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, m->listen_fd, &event) != 0) {
+        perror("epoll_ctl");
+        metrics_close(m);
+        return -1;
+    }
+
+    loop->metrics = m;
+    return 0;
+}
+
+// Function to take the values and round-trip times of a finished cycle
+void metrics_record_cycle(struct metrics_server *m, const struct modem_device *dev) {
+    const struct cycle_state *cycle = &dev->cycle;
+    int32_t *values = m->values + (size_t)dev->index * m->field_count;
+
+    for (int i = 0; i < m->count; i++) {
+        if (!cycle->due[i]) {
+            continue;
+        }
+
+        const struct response_info *info = &cycle->infos[i];
+        if (info->complete && info->rtt_us > 0) {
+            struct metrics_histogram *h = &m->latency[i];
+            for (int b = METRICS_LATENCY_BUCKETS - 1; b >= 0 && info->rtt_us <= metrics_latency_bounds_us[b]; b--) {
+                h->buckets[b]++;
+            }
+            h->count++;
+            h->sum_us += info->rtt_us;
+        }
+
+        const struct response_parser *parser = m->parsers[i];
+        if (parser != NULL) {
+            int parsed[FIELD_MAX];
+            int ok = !info->error && parser->parse(parser, cycle->responses[i].data, cycle->responses[i].len, parsed) == 0;
+            for (int f = 0; f < parser->field_count; f++) {
+                values[m->first_field[i] + f] = ok ? parsed[f] : FIELD_MISSING;
+            }
+        }
+    }
+}
+
+// Function to write an unsigned number, returns the end of it
+static char *metrics_put_unsigned(char *p, unsigned long long value) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+// Function to render the metrics text into buf, returns its length
+static size_t metrics_render(const struct metrics_server *m, char *buf) {
+    char *p = buf;
+
+    for (int s = 0; s < m->series_count; s++) {
+        const struct metrics_series *series = &m->series[s];
+        memcpy(p, m->names + series->name, series->name_len);
+        p += series->name_len;
+
+        switch (series->kind) {
+        case METRIC_TEXT:
+            continue;
+        case METRIC_ULONG:
+            p = metrics_put_unsigned(p, *(const unsigned long *)series->value);
+            break;
+        case METRIC_ULLONG:
+            p = metrics_put_unsigned(p, *(const unsigned long long *)series->value);
+            break;
+        case METRIC_INT32: {
+            int32_t value = *(const int32_t *)series->value;
+            if (value == FIELD_MISSING) {
+                memcpy(p, "NaN", 3);
+                p += 3;
+            } else {
+                if (value < 0) {
+                    *p++ = '-';
+                }
+                p = metrics_put_unsigned(p, value < 0 ? -(long long)value : value);
+            }
+            break;
+        }
+        case METRIC_UP:
+            *p++ = *(const int *)series->value == DEVICE_OFFLINE ? '0' : '1';
+            break;
+        case METRIC_MICROS: {
+            long long us = *(const long long *)series->value;
+            p = metrics_put_unsigned(p, us / 1000000);
+            *p++ = '.';
+            char fraction[8];
+            char *end = metrics_put_unsigned(fraction, 1000000 + us % 1000000); // Keeps the leading zeros
+            memcpy(p, fraction + 1, end - fraction - 1);
+            p += end - fraction - 1;
+            break;
+        }
+        }
+        *p++ = '\n';
+    }
+    return p - buf;
+}
+
+// Function to close a scrape connection and free its slot
+static void metrics_client_close(struct metrics_server *m, struct metrics_client *c) {
+    epoll_ctl(m->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+// Function to accept scrape connections
+// Connections beyond METRICS_MAX_CLIENTS are closed unless a slot has been
+// stuck longer than METRICS_CLIENT_TIMEOUT.
+static void metrics_accept(struct metrics_server *m) {
+    while (1) {
+        int fd = accept4(m->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+
+        long long now = monotonic_ms();
+        int slot = -1;
+        for (int c = 0; c < METRICS_MAX_CLIENTS && slot < 0; c++) {
+            if (m->clients[c].fd < 0) {
+                slot = c;
+            } else if (now - m->clients[c].accepted_ms > METRICS_CLIENT_TIMEOUT) {
+                metrics_client_close(m, &m->clients[c]);
+                slot = c;
+            }
+        }
+        struct epoll_event event = { .events = EPOLLIN, .data.u64 = EVENT_METRICS + 1 + slot };
+        if (slot < 0 || epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            continue;
+        }
+
+        struct metrics_client *c = &m->clients[slot];
+        c->fd = fd;
+        c->request_len = 0;
+        c->response_len = 0;
+        c->sent = 0;
+        c->accepted_ms = now;
+    }
+}
+
+// Function to build the answer to a complete request
+static void metrics_respond(struct metrics_server *m, struct metrics_client *c) {
+    const char *status = "404 Not Found";
+    size_t body_len;
+    char *body = c->response + 256; // The header goes right before the body
+
+    if (strncmp(c->request, "GET /metrics", 12) == 0 && strchr(" ?", c->request[12]) != NULL) {
+        m->scrapes++;
+        status = "200 OK";
+        body_len = metrics_render(m, body);
+    } else {
+        body_len = snprintf(body, 32, "Not found, try /metrics\n");
+    }
+
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body_len);
+    memcpy(body - header_len, header, header_len);
+    c->sent = 256 - header_len;
+    c->response_len = 256 + body_len;
+}
+
+// Function to serve an event of the metrics endpoint
+// tag is 0 for the listening socket and 1 + slot for a scrape connection.
+void metrics_event(struct metrics_server *m, uint64_t tag) {
+    if (tag == 0) {
+        metrics_accept(m);
+        return;
+    }
+    struct metrics_client *c = &m->clients[tag - 1];
+    if (c->fd < 0) {
+        return;
+    }
+
+    // Collect the request header
+    if (c->response_len == 0) {
+        ssize_t n = read(c->fd, c->request + c->request_len, sizeof(c->request) - 1 - c->request_len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        } else if (n <= 0) {
+            metrics_client_close(m, c);
+            return;
+        }
+        c->request_len += n;
+        c->request[c->request_len] = '\0';
+        if (strstr(c->request, "\r\n\r\n") == NULL && strstr(c->request, "\n\n") == NULL &&
+            c->request_len < sizeof(c->request) - 1) {
+            return;
+        }
+        metrics_respond(m, c);
+    }
+
+    // Send what the socket takes, the rest when it is writable again
+    while (c->sent < c->response_len) {
+        ssize_t n = send(c->fd, c->response + c->sent, c->response_len - c->sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct epoll_event event = { .events = EPOLLOUT, .data.u64 = EVENT_METRICS + tag };
+            epoll_ctl(m->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+            return;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        c->sent += n;
+    }
+    metrics_client_close(m, c);
+}
+
+// Function to stop the metrics endpoint
+void metrics_close(struct metrics_server *m) {
+    for (int c = 0; c < METRICS_MAX_CLIENTS; c++) {
+        if (m->clients[c].fd >= 0) {
+            metrics_client_close(m, &m->clients[c]);
+        }
+        free(m->clients[c].response);
+        m->clients[c].response = NULL;
+    }
+    if (m->listen_fd >= 0) {
+        close(m->listen_fd);
+        m->listen_fd = -1;
+    }
+    free(m->names);
+    free(m->series);
+    free(m->parsers);
+    free(m->first_field);
+    free(m->values);
+    free(m->latency);
+    m->names = NULL;
+    m->series = NULL;
+    m->parsers = NULL;
+    m->first_field = NULL;
+    m->values = NULL;
+    m->latency = NULL;
+}
+
+// Function to print what the run cost and achieved
+// CPU time is the whole process, writer and compressor threads included.
+void performance_report(const struct event_loop *loop) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        perror("getrusage");
+        return;
+    }
+
+    double wall_s = (loop->end_ns - loop->start_ns) / 1e9;
+    double cpu_s = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                   usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    double rate = wall_s > 0 ? loop->samples / wall_s : 0.0;
+    double core = wall_s > 0 ? 100.0 * cpu_s / wall_s : 0.0;
+
+    printf("Performance: %d devices, %.2f s\n", loop->device_count, wall_s);
+    if (loop->bench == NULL) {
+        // Every command of every device sampled once per period
+        double target = 0.0;
+        for (int i = 0; i < loop->sched->count; i++) {
+            target += 1e9 / loop->sched->period_ns[i];
+        }
+        target *= loop->device_count;
+        printf("  Samples: %lu, %.1f/s of %.1f/s target (%.1f%%)\n", loop->samples, rate, target,
+               target > 0 ? 100.0 * rate / target : 0.0);
+    } else {
+        printf("  Samples: %lu, %.1f/s\n", loop->samples, rate);
+    }
+    printf("  Cycle latency (ms): p50 %.3f, p99 %.3f, max %.3f\n",
+           histogram_percentile(&loop->cycle_latency, 50) / 1000.0,
+           histogram_percentile(&loop->cycle_latency, 99) / 1000.0,
+           loop->cycle_latency.max_us / 1000.0);
+    printf("  CPU: %.2f s user, %.2f s system, %.1f%% of a core, %.3f%% per device\n",
+           usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6, usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+           core, loop->device_count > 0 ? core / loop->device_count : 0.0);
+    printf("  Max RSS: %ld KiB\n", usage.ru_maxrss);
+}
+
+// Function to record a latency in a histogram
+void histogram_add(struct latency_histogram *h, long long us) {
+    int index;
+    if (us < HISTOGRAM_EXACT) {
+        index = us > 0 ? (int)us : 0;
+    } else {
+        int exponent = 63 - __builtin_clzll((unsigned long long)us); // At least 4
+        int sub = (int)(us >> (exponent - 3)) & (HISTOGRAM_SUB_BUCKETS - 1);
+        index = HISTOGRAM_EXACT + (exponent - 4) * HISTOGRAM_SUB_BUCKETS + sub;
+    }
+    h->counts[index]++;
+    h->total++;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+}
+
+// Function to get a nearest-rank percentile from a histogram
+// Returns the upper bound of the bucket holding it, in microseconds.
+long long histogram_percentile(const struct latency_histogram *h, int percent) {
+    unsigned long rank = (h->total * percent + 99) / 100;
+    unsigned long seen = 0;
+    if (rank == 0) {
+        return 0;
+    }
+
+    for (int index = 0; index < HISTOGRAM_BUCKETS; index++) {
+        seen += h->counts[index];
+        if (seen < rank) {
+            continue;
+        }
+        if (index < HISTOGRAM_EXACT) {
+            return index;
+        }
+        int exponent = (index - HISTOGRAM_EXACT) / HISTOGRAM_SUB_BUCKETS + 4;
+        int sub = (index - HISTOGRAM_EXACT) % HISTOGRAM_SUB_BUCKETS;
+        long long upper = ((long long)(HISTOGRAM_SUB_BUCKETS + sub + 1) << (exponent - 3)) - 1;
+        return upper < h->max_us ? upper : h->max_us;
+    }
+    return h->max_us;
+}
+
+// Function to record a value in an I/O histogram (one writing thread)
+void io_histogram_add(struct io_histogram *h, long long value) {
+    int index = value > 0 ? 64 - __builtin_clzll((unsigned long long)value) : 0;
+    if (index >= IO_HISTOGRAM_BUCKETS) {
+        index = IO_HISTOGRAM_BUCKETS - 1;
+    }
+    STAT_ADD(h->counts[index], 1);
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+    }
+}
+
+// Function to get a nearest-rank percentile from an I/O histogram
+// Returns the upper bound of the bucket holding it.
+long long io_histogram_percentile(const struct io_histogram *h, int percent) {
+    unsigned long counts[IO_HISTOGRAM_BUCKETS], total = 0;
+    for (int index = 0; index < IO_HISTOGRAM_BUCKETS; index++) {
+        counts[index] = atomic_load_explicit(&h->counts[index], memory_order_relaxed);
+        total += counts[index];
+    }
+    long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+    unsigned long rank = (total * percent + 99) / 100;
+    unsigned long seen = 0;
+    if (rank == 0) {
+        return 0;
+    }
+    for (int index = 0; index < IO_HISTOGRAM_BUCKETS; index++) {
+        seen += counts[index];
+        if (seen >= rank) {
+            long long upper = index > 0 ? (1LL << index) - 1 : 0;
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+// Function to print the I/O counters
+// Safe to call while polling: every counter is read with a relaxed load.
+void io_stats_dump(FILE *out) {
+    const struct io_stats *s = &io_stats;
+    #define STAT(counter) atomic_load_explicit(&s->counter, memory_order_relaxed)
+    unsigned long syscalls = STAT(serial_reads) + STAT(serial_writes) + STAT(waits) + STAT(drains) +
+                             STAT(file_writes) + STAT(fsyncs);
+
+    fprintf(out, "I/O: %lu system calls\n", syscalls);
+    fprintf(out, "  Serial reads: %lu, %llu bytes, %lu EAGAIN, %lu partial responses\n",
+            STAT(serial_reads), STAT(serial_read_bytes), STAT(serial_eagain), STAT(partial_reads));
+    fprintf(out, "  Serial writes: %lu, %llu bytes, %lu short; latency (us) p50 %lld, p99 %lld, max %lld\n",
+            STAT(serial_writes), STAT(serial_write_bytes), STAT(short_writes),
+            io_histogram_percentile(&s->serial_write_latency, 50), io_histogram_percentile(&s->serial_write_latency, 99),
+            STAT(serial_write_latency.max));
+    fprintf(out, "  Waits: %lu, timeouts: %lu\n", STAT(waits), STAT(timeouts));
+    fprintf(out, "  Drains: %lu, %llu bytes pending, %lu stray lines, %llu bytes of incomplete lines kept\n",
+            STAT(drains), STAT(drained_bytes), STAT(stray_lines), STAT(drain_incomplete));
+    fprintf(out, "  Stray bytes per cycle: p50 %lld, p99 %lld, max %lld\n",
+            io_histogram_percentile(&s->stray_per_cycle, 50), io_histogram_percentile(&s->stray_per_cycle, 99),
+            STAT(stray_per_cycle.max));
+    fprintf(out, "  Data file writes: %lu, %llu bytes, %lu fsyncs; latency (us) p50 %lld, p99 %lld, max %lld\n",
+            STAT(file_writes), STAT(file_write_bytes), STAT(fsyncs),
+            io_histogram_percentile(&s->file_write_latency, 50), io_histogram_percentile(&s->file_write_latency, 99),
+            STAT(file_write_latency.max));
+    #undef STAT
+    fflush(out);
+}
+
+// Function to add nanoseconds to a timespec
+static void timespec_add_ns(struct timespec *ts, long long ns) {
+    long long total = ts->tv_nsec + ns;
+    ts->tv_sec += total / 1000000000LL;
+    ts->tv_nsec = total % 1000000000LL;
+}
+
+// Function to compute a - b in nanoseconds
+static long long timespec_diff_ns(const struct timespec *a, const struct timespec *b) {
+    return (long long)(a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+// Function to start a timeline on which every command is due now
+// periods[] holds each command's period in milliseconds, 0 for the global interval.
+int scheduler_init(struct scheduler *sched, struct arena *arena, int count, const int periods[], int interval_ms, int skip_missed) {
+    struct timespec now;
+
+    sched->count = count;
+    sched->period_ns = arena_alloc(arena, count * sizeof(long long));
+    sched->next = arena_alloc(arena, count * sizeof(struct timespec));
+    if (count > 0 && (sched->period_ns == NULL || sched->next == NULL)) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < count; i++) {
+        int period_ms = periods[i] > 0 ? periods[i] : interval_ms;
+        sched->period_ns[i] = (long long)(period_ms > 0 ? period_ms : 1) * 1000000LL;
+        sched->next[i] = now;
+    }
+
+    sched->skip_missed = skip_missed;
+    sched->ticks = 0;
+    sched->overruns = 0;
+    sched->skipped = 0;
+    sched->max_late_us = 0;
+    sched->unreported = 0;
+    sched->next_report_ns = 0;
+    return 0;
+}
+
+// Function to arm the event loop timer at the earliest command deadline
+int scheduler_arm(struct scheduler *sched, int timer_fd) {
+    if (sched->count == 0) {
+        return -1;
+    }
+
+    struct itimerspec wake = { 0 };
+    wake.it_value = sched->next[0];
+    for (int i = 1; i < sched->count; i++) {
+        if (timespec_diff_ns(&sched->next[i], &wake.it_value) < 0) {
+            wake.it_value = sched->next[i];
+        }
+    }
+
+    // A zero time would disarm the timer
+    if (wake.it_value.tv_sec == 0 && wake.it_value.tv_nsec == 0) {
+        wake.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &wake, NULL) != 0) {
+        perror("timerfd_settime");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to mark the commands whose deadline has been reached
+void scheduler_collect(struct scheduler *sched, unsigned char due[]) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < sched->count; i++) {
+        due[i] = timespec_diff_ns(&now, &sched->next[i]) >= 0;
+    }
+    sched->ticks++;
+}
+
+// Function to move the deadlines of the commands that were just sampled
+// A command whose next deadline has already passed makes the cycle an overrun;
+// it then runs again at once, or with skip_missed, at its next future tick.
+// Overruns are counted for the report and the metrics; a verbose console also
+// gets a message, at most every OVERRUN_REPORT_INTERVAL seconds.
+void scheduler_advance(struct scheduler *sched, const unsigned char due[], int verbose) {
+    struct timespec now;
+    long long worst_ns = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < sched->count; i++) {
+        if (!due[i]) {
+            continue;
+        }
+
+        timespec_add_ns(&sched->next[i], sched->period_ns[i]);
+        long long late_ns = timespec_diff_ns(&now, &sched->next[i]);
+        if (late_ns <= 0) {
+            continue;
+        }
+
+        if (late_ns > worst_ns) {
+            worst_ns = late_ns;
+        }
+        if (sched->skip_missed) {
+            // Realign to the first tick still in the future
+            long long missed = late_ns / sched->period_ns[i] + 1;
+            timespec_add_ns(&sched->next[i], missed * sched->period_ns[i]);
+            sched->skipped += missed;
+        }
+    }
+
+    if (worst_ns <= 0) {
+        return;
+    }
+    sched->overruns++;
+    sched->unreported++;
+    if (worst_ns / 1000 > sched->max_late_us) {
+        sched->max_late_us = worst_ns / 1000;
+    }
+
+    long long now_ns = (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (verbose && now_ns >= sched->next_report_ns) {
+        fprintf(stderr, "Cycle overran a command deadline by %.1f ms (overruns since the last message: %lu)\n",
+                worst_ns / 1e6, sched->unreported);
+        sched->unreported = 0;
+        sched->next_report_ns = now_ns + OVERRUN_REPORT_INTERVAL * 1000000000LL;
+    }
+}
+
+// Function to allocate the storage for benchmark samples
+int bench_init(struct bench_samples *bench, int cycles, int command_count) {
+    bench->cycles = 0;
+    bench->max_cycles = cycles;
+    bench->command_count = command_count;
+    bench->rtt_us = malloc((size_t)cycles * (command_count > 0 ? command_count : 1) * sizeof(long long));
+    bench->samples = calloc(command_count > 0 ? command_count : 1, sizeof(int));
+    bench->failures = calloc(command_count > 0 ? command_count : 1, sizeof(int));
+    bench->cycle_us = malloc((size_t)cycles * sizeof(long long));
+    if (bench->rtt_us == NULL || bench->samples == NULL || bench->failures == NULL || bench->cycle_us == NULL) {
+        perror("Error allocating memory for benchmark samples");
+        bench_free(bench);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to record the round-trip times of one cycle
+// Timed-out and failed responses are only counted: their times would skew the percentiles.
+void bench_record(struct bench_samples *bench, const struct response_info infos[], long long cycle_us) {
+    if (bench->cycles >= bench->max_cycles) {
+        return;
+    }
+    for (int i = 0; i < bench->command_count; i++) {
+        if (!infos[i].complete || infos[i].error) {
+            bench->failures[i]++;
+            continue;
+        }
+        bench->rtt_us[(size_t)i * bench->max_cycles + bench->samples[i]++] = infos[i].rtt_us;
+    }
+    bench->cycle_us[bench->cycles++] = cycle_us;
+}
+
+// Function to compare two samples for qsort()
+static int compare_samples(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to print the percentiles of a set of samples (sorts them in place)
+// failures is left out of the line when negative.
+static void print_percentiles(const char *name, long long *samples, int n, int failures) {
+    char failed[16] = "";
+    if (failures >= 0) {
+        snprintf(failed, sizeof(failed), " %8d", failures);
+    }
+    if (n == 0) {
+        printf("%-32s %10s %10s %10s %10s%s\n", name, "-", "-", "-", "-", failed);
+        return;
+    }
+    qsort(samples, n, sizeof(samples[0]), compare_samples);
+
+    // Nearest-rank percentiles
+    long long p50 = samples[(n * 50 + 99) / 100 - 1];
+    long long p90 = samples[(n * 90 + 99) / 100 - 1];
+    long long p99 = samples[(n * 99 + 99) / 100 - 1];
+    printf("%-32s %10.3f %10.3f %10.3f %10.3f%s\n", name,
+           p50 / 1000.0, p90 / 1000.0, p99 / 1000.0, samples[n - 1] / 1000.0, failed);
+}
+
+// Function to print the benchmark report
+void bench_report(const struct bench_samples *bench, char *commands[]) {
+    printf("\nBenchmark: %d cycles\n", bench->cycles);
+    printf("%-32s %10s %10s %10s %10s %8s\n", "Command (ms)", "p50", "p90", "p99", "max", "failed");
+    for (int i = 0; i < bench->command_count; i++) {
+        print_percentiles(commands[i], bench->rtt_us + (size_t)i * bench->max_cycles, bench->samples[i], bench->failures[i]);
+    }
+    print_percentiles("Total cycle", bench->cycle_us, bench->cycles, -1);
+}
+
+// Function to release the benchmark samples
+void bench_free(struct bench_samples *bench) {
+    free(bench->rtt_us);
+    free(bench->samples);
+    free(bench->failures);
+    free(bench->cycle_us);
+    bench->samples = bench->failures = NULL;
+    bench->rtt_us = NULL;
+    bench->cycle_us = NULL;
+}
+
+// Function to read configuration from a file
+int read_config_file(const char *filename, char *devices[], int *device_count, int max_devices, int *baud_rate, char *commands[], int periods[], unsigned char on_change[], int max_count, int *interval, char **output_folder, int *response_timeout, int *pipeline, int *skip_missed, int *output_format, struct writer_policy *policy, struct rotation_policy *rotation, int *keyframe_interval, int *command_timestamps, int *console_mode, int *dashboard_refresh, int *record_urcs, int *urc_subscribe, char **shm_name, int *metrics_port) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror("Error opening configuration file");
+        fprintf(stderr, "File path provided: %s\n", filename); // Additional debug info
+        return -1;
+    }
+
+    char line[256];
+    int count = 0;
+    int in_commands_block = 0;
+    char command_buffer[1024] = {0}; // Buffer to accumulate commands across lines
+
+    // Default output folder
+    *output_folder = strdup(DEFAULT_OUTPUT_FOLDER);
+    if (*output_folder == NULL) {
+        perror("Error allocating memory for output folder");
+        fclose(file);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        // Remove trailing newline characters
+        line[strcspn(line, "\r\n")] = '\0';
+
+        // Convert to lowercase for case-insensitive comparison
+        char lower_line[256];
+        strncpy(lower_line, line, sizeof(lower_line));
+        lower_line[sizeof(lower_line) - 1] = '\0';
+        to_lowercase(lower_line);
+
+        if (strncmp(lower_line, "device:", 7) == 0) {
+            // Every device: line adds a modem, polled with the same commands
+            if (*device_count >= max_devices) {
+                fprintf(stderr, "Too many devices, '%s' ignored\n", line);
+                continue;
+            }
+            char *device = strdup(line + 7); // Preserve the case of the device path
+            if (device == NULL) {
+                perror("Error allocating memory for device");
+                fclose(file);
+                return -1;
+            }
+            trim_whitespace(device);
+            remove_surrounding_quotes(device);
+            devices[(*device_count)++] = device;
+        } else if (strncmp(lower_line, "baud_rate:", 10) == 0) {
+            *baud_rate = atoi(line + 10);
+        } else if (strncmp(lower_line, "commands:", 9) == 0) {
+            in_commands_block = 1; // Start reading commands block
+            continue;
+        } else if (strncmp(lower_line, "interval:", 9) == 0) {
+            *interval = parse_duration_ms(line + 9);
+            if (*interval <= 0) {
+                fprintf(stderr, "Invalid setting '%s' ignored\n", line);
+                *interval = DEFAULT_INTERVAL;
+            }
+        } else if (strncmp(lower_line, "response_timeout:", 17) == 0) {
+            *response_timeout = parse_duration_ms(line + 17);
+            if (*response_timeout <= 0) {
+                fprintf(stderr, "Invalid setting '%s' ignored\n", line);
+                *response_timeout = DEFAULT_RESPONSE_TIMEOUT;
+            }
+        } else if (strncmp(lower_line, "pipeline:", 9) == 0) {
+            *pipeline = parse_bool(lower_line + 9);
+        } else if (strncmp(lower_line, "output_format:", 14) == 0) {
+            char *format = lower_line + 14;
+            trim_whitespace(format);
+            if (strcmp(format, "binary") == 0) {
+                *output_format = OUTPUT_BINARY;
+            } else if (strcmp(format, "csv") == 0) {
+                *output_format = OUTPUT_CSV;
+            } else {
+                fprintf(stderr, "Unknown output format '%s', using csv\n", format);
+            }
+        } else if (strncmp(lower_line, "flush_policy:", 13) == 0 || strncmp(lower_line, "fsync_policy:", 13) == 0) {
+            if (parse_writer_policy(lower_line, lower_line + 13, policy) != 0) {
+                fprintf(stderr, "Invalid setting '%s' ignored\n", line);
+            }
+        } else if (strncmp(lower_line, "rotate_size:", 12) == 0) {
+            char *size = lower_line + 12;
+            trim_whitespace(size);
+            rotation->max_bytes = strcmp(size, "off") == 0 || strcmp(size, "none") == 0 ? 0 : parse_size_bytes(size);
+            if (rotation->max_bytes < 0) {
+                fprintf(stderr, "Invalid setting '%s' ignored\n", line);
+                rotation->max_bytes = 0;
+            }
+        } else if (strncmp(lower_line, "rotate_time:", 12) == 0) {
+            char *period = lower_line + 12;
+            trim_whitespace(period);
+            if (strcmp(period, "hourly") == 0) {
+                rotation->period = ROTATE_HOURLY;
+            } else if (strcmp(period, "daily") == 0) {
+                rotation->period = ROTATE_DAILY;
+            } else if (strcmp(period, "off") == 0 || strcmp(period, "none") == 0) {
+                rotation->period = ROTATE_NONE;
+            } else {
+                fprintf(stderr, "Invalid setting '%s' ignored\n", line);
+            }
+        } else if (strncmp(lower_line, "keyframe_interval:", 18) == 0) {
+            *keyframe_interval = parse_duration_ms(lower_line + 18);
+            if (*keyframe_interval <= 0) {
+                fprintf(stderr, "Invalid setting '%s' ignored\n", line);
+                *keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+            }
+        } else if (strncmp(lower_line, "console:", 8) == 0) {
+            char *mode = lower_line + 8;
+            trim_whitespace(mode);
+            if (strcmp(mode, "verbose") == 0) {
+                *console_mode = CONSOLE_VERBOSE;
+            } else if (strcmp(mode, "quiet") == 0) {
+                *console_mode = CONSOLE_QUIET;
+            } else if (strcmp(mode, "dashboard") == 0) {
+                *console_mode = CONSOLE_DASHBOARD;
+            } else {
+                fprintf(stderr, "Invalid setting '%s' ignored\n", line);
+            }
+        } else if (strncmp(lower_line, "dashboard_refresh:", 18) == 0) {
+            *dashboard_refresh = parse_duration_ms(lower_line + 18);
+            if (*dashboard_refresh < 0) {
+                fprintf(stderr, "Invalid setting '%s' ignored\n", line);
+                *dashboard_refresh = DEFAULT_DASHBOARD_REFRESH;
+            }
+        } else if (strncmp(lower_line, "urc:", 4) == 0) {
+            *record_urcs = parse_bool(lower_line + 4);
+        } else if (strncmp(lower_line, "urc_subscribe:", 14) == 0) {
+            *urc_subscribe = parse_bool(lower_line + 14);
+        } else if (strncmp(lower_line, "command_timestamps:", 19) == 0) {
+            *command_timestamps = parse_bool(lower_line + 19);
+        } else if (strncmp(lower_line, "compress:", 9) == 0) {
+            rotation->compress = parse_bool(lower_line + 9);
+        } else if (strncmp(lower_line, "skip_missed:", 12) == 0) {
+            *skip_missed = parse_bool(lower_line + 12);
+        } else if (strncmp(lower_line, "metrics_port:", 13) == 0) {
+            char *value = lower_line + 13;
+            trim_whitespace(value);
+            *metrics_port = strcmp(value, "off") == 0 ? 0 : atoi(value);
+            if (*metrics_port < 0 || *metrics_port > 65535) {
+                fprintf(stderr, "Invalid setting '%s' ignored\n", line);
+                *metrics_port = 0;
+            }
+        } else if (strncmp(lower_line, "shared_memory:", 14) == 0) {
+            char *name = line + 14;
+            trim_whitespace(name);
+            remove_surrounding_quotes(name);
+            free(*shm_name);
+            *shm_name = NULL;
+            if (strcasecmp(name, "off") != 0 && (*shm_name = strdup(name)) == NULL) {
+                perror("Error allocating memory for shared memory name");
+                fclose(file);
+                return -1;
+            }
+        } else if (strncmp(lower_line, "output_folder:", 14) == 0) {
+            free(*output_folder);
+            *output_folder = strdup(line + 14);
+            if (*output_folder == NULL) {
+                perror("Error allocating memory for output folder");
+                fclose(file);
+                return -1;
+            }
+            trim_whitespace(*output_folder);
+            remove_surrounding_quotes(*output_folder);
+        }
+
+        if (in_commands_block) {
+            if (line[0] == '}') {
+                break; // End of commands block
+            } else if (line[0] == '{') {
+                continue; // Skip opening brace
+            }
+
+            // Concatenate lines in the commands block
+            strcat(command_buffer, line);
+
+            // Split commands separated by commas
+            char *cmd = strtok(command_buffer, ",");
+            while (cmd != NULL) {
+                // Trim whitespace around commands
+                trim_whitespace(cmd);
+
+                // Split off the options: "AT+CREG? @5s on_change"
+                on_change[count] = split_command_flags(cmd);
+                periods[count] = split_command_period(cmd);
+
+                // Remove surrounding quotes if present
                 remove_surrounding_quotes(cmd);
 
-                // Store the command
-                commands[count] = strdup(cmd);
-                if (commands[count] == NULL) {
-                    perror("Error allocating memory for command");
-                    fclose(file);
-                    return -1;
-                }
-                count++;
-                cmd = strtok(NULL, ",");
+                // Store the command
+                commands[count] = strdup(cmd);
+                if (commands[count] == NULL) {
+                    perror("Error allocating memory for command");
+                    fclose(file);
+                    return -1;
+                }
+                count++;
+                cmd = strtok(NULL, ",");
+
+                if (count >= max_count) {
+                    break; // Stop if we reach the maximum number of commands
+                }
+            }
+
+            // Clear the command buffer for the next line
+            memset(command_buffer, 0, sizeof(command_buffer));
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+// Function to split off a trailing "on_change" flag from a command
+// The command is then only recorded when its response differs from the last
+// recorded one. Returns 1 if the flag was present.
+int split_command_flags(char *command) {
+    size_t len = strlen(command);
+    size_t flag_len = strlen("on_change");
+
+    if (len <= flag_len || strcasecmp(command + len - flag_len, "on_change") != 0 ||
+        !isspace((unsigned char)command[len - flag_len - 1])) {
+        return 0;
+    }
+
+    command[len - flag_len] = '\0';
+    trim_whitespace(command);
+    return 1;
+}
+
+// Function to parse a duration such as "500ms", "2s", "5m" or "1h"
+// A number without a unit is taken as milliseconds. Returns -1 if invalid, out
+// of range or a non-zero value under a millisecond.
+int parse_duration_ms(const char *value) {
+    char *end;
+    double amount = strtod(value, &end);
+    if (end == value || !(amount >= 0)) {
+        return -1; // Also rejects NaN
+    }
+
+    double ms;
+    while (isspace((unsigned char)*end)) end++;
+    if (*end == '\0' || strncasecmp(end, "ms", 2) == 0) {
+        ms = amount;
+    } else if (strncasecmp(end, "s", 1) == 0) {
+        ms = amount * 1000;
+    } else if (strncasecmp(end, "min", 3) == 0 || strncasecmp(end, "m", 1) == 0) {
+        ms = amount * 60 * 1000;
+    } else if (strncasecmp(end, "h", 1) == 0) {
+        ms = amount * 60 * 60 * 1000;
+    } else {
+        return -1;
+    }
+
+    if (ms > INT_MAX || (amount > 0 && ms < 1)) {
+        return -1;
+    }
+    return (int)ms;
+}
+
+// Function to split "COMMAND @period" into the command and its period
+// The command is truncated in place. Returns the period in milliseconds, or 0
+// when the command has none (it then follows the global interval).
+int split_command_period(char *command) {
+    char *at = strrchr(command, '@');
+    const char *value = at ? at + 1 : NULL;
+    while (value && isspace((unsigned char)*value)) value++;
+    if (value == NULL || !isdigit((unsigned char)*value)) {
+        return 0;
+    }
+
+    int period = parse_duration_ms(value);
+    if (period <= 0) {
+        fprintf(stderr, "Invalid polling period '%s' ignored\n", at);
+        period = 0;
+    }
+
+    *at = '\0';
+    trim_whitespace(command);
+    return period;
+}
+
+// Function to parse "flush_policy: row | rows N | interval T" and
+// "fsync_policy: none | flush | group T" (T is a duration such as 500ms or 5s)
+int parse_writer_policy(const char *key, const char *value, struct writer_policy *policy) {
+    while (isspace((unsigned char)*value)) value++;
+
+    if (strncmp(key, "flush_policy:", 13) == 0) {
+        if (strncmp(value, "rows", 4) == 0) {
+            int rows = atoi(value + 4 + strspn(value + 4, " \t:"));
+            if (rows <= 0) {
+                return -1;
+            }
+            policy->flush_mode = FLUSH_ROWS;
+            policy->flush_rows = rows;
+        } else if (strncmp(value, "row", 3) == 0) {
+            policy->flush_mode = FLUSH_ROW;
+        } else if (strncmp(value, "interval", 8) == 0) {
+            int ms = parse_duration_ms(value + 8 + strspn(value + 8, " \t:"));
+            if (ms <= 0) {
+                return -1;
+            }
+            policy->flush_mode = FLUSH_INTERVAL;
+            policy->flush_interval_ms = ms;
+        } else {
+            return -1;
+        }
+    } else {
+        if (strncmp(value, "none", 4) == 0) {
+            policy->fsync_mode = FSYNC_NONE;
+        } else if (strncmp(value, "flush", 5) == 0) {
+            policy->fsync_mode = FSYNC_FLUSH;
+        } else if (strncmp(value, "group", 5) == 0) {
+            int ms = parse_duration_ms(value + 5 + strspn(value + 5, " \t:"));
+            if (ms <= 0) {
+                return -1;
+            }
+            policy->fsync_mode = FSYNC_GROUP;
+            policy->fsync_interval_ms = ms;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to parse a size such as "512K", "64M" or "2G" (powers of 1024)
+// A number without a unit is taken as bytes. Returns -1 if invalid.
+long long parse_size_bytes(const char *value) {
+    char *end;
+    double amount = strtod(value, &end);
+    if (end == value || amount < 0) {
+        return -1;
+    }
+
+    while (isspace((unsigned char)*end)) end++;
+    switch (tolower((unsigned char)*end)) {
+    case '\0': case 'b': return (long long)amount;
+    case 'k': return (long long)(amount * 1024);
+    case 'm': return (long long)(amount * 1024 * 1024);
+    case 'g': return (long long)(amount * 1024 * 1024 * 1024);
+    default: return -1;
+    }
+}
+
+// Function to interpret an on/off configuration value
+int parse_bool(const char *value) {
+    while (isspace((unsigned char)*value)) value++;
+    return strncmp(value, "on", 2) == 0 || strncmp(value, "yes", 3) == 0 ||
+           strncmp(value, "true", 4) == 0 || strncmp(value, "1", 1) == 0;
+}
+
+// Function to convert string to lowercase
+void to_lowercase(char *str) {
+    for (char *p = str; *p; p++) {
+        *p = tolower((unsigned char)*p);
+    }
+}
+
+// Function to trim whitespace from the start and end of a string
+void trim_whitespace(char *str) {
+    char *start = str;
+    char *end;
+
+    // Trim leading space
+    while (isspace((unsigned char)*start)) start++;
+
+    if (start != str) {
+        memmove(str, start, strlen(start) + 1);
+    }
+
+    if (*str == 0)  // All spaces?
+        return;
+
+    // Trim trailing space
+    end = str + strlen(str) - 1;
+    while (end > str && isspace((unsigned char)*end)) end--;
+
+    // Null terminate after the last non-space character
+    *(end + 1) = '\0';
+}
+
+// Function to remove surrounding quotes from a string
+void remove_surrounding_quotes(char *str) {
+    size_t len = strlen(str);
+    if (len > 1 && str[0] == '\"' && str[len - 1] == '\"') {
+        // Shift the string to remove the quotes
+        memmove(str, str + 1, len - 1);
+        str[len - 2] = '\0';
+    }
+}
+
+// Function to create a CSV file with the current timestamp
+// The name of the new file is stored in filename (OUTPUT_PATH_MAX bytes) and
+// the size of the header in *offset.
+// Commands with a parser get one "<command> <field>" column per field, and with
+// command_timestamps every command is followed by "sent" and "received" columns
+// (CLOCK_REALTIME in nanoseconds).
+int create_csv_file(struct file_writer *w, char *commands[], const struct response_parser *parsers[], int count, int command_timestamps, int record_urcs, const char *output_folder, const char *label, const struct writer_policy *policy, char *filename, uint64_t *offset) {
+    if (format_output_filename(filename, OUTPUT_PATH_MAX, output_folder, label, "csv") != 0) {
+        return -1;
+    }
+
+    if (writer_open(w, filename, policy) != 0) {
+        perror("Error creating CSV file");
+        return -1;
+    }
+
+    // Write the header row to the CSV file
+    writer_append(w, "Timestamp", 9);
+    for (int i = 0; i < count; i++) {
+        static const char *const timestamp_fields[] = { "sent", "received" };
+        char column[300];
+        int fields = parsers[i] ? parsers[i]->field_count : 1;
+        int columns = fields + (command_timestamps ? 2 : 0);
+        for (int f = 0; f < columns; f++) {
+            int len;
+            if (f >= fields) {
+                len = snprintf(column, sizeof(column), "%s %s", commands[i], timestamp_fields[f - fields]);
+            } else if (parsers[i] != NULL) {
+                len = snprintf(column, sizeof(column), "%s %s", commands[i], parsers[i]->fields[f]);
+            } else {
+                len = snprintf(column, sizeof(column), "%s", commands[i]);
+            }
+            if (len >= (int)sizeof(column)) {
+                len = sizeof(column) - 1;
+            }
+
+            // Commands such as AT+QENG="servingcell" contain quotes
+            writer_append(w, ",\"", 2);
+            for (const char *c = column; c < column + len; c++) {
+                writer_append(w, c, 1);
+                if (*c == '"') {
+                    writer_append(w, "\"", 1);
+                }
+            }
+            writer_append(w, "\"", 1);
+        }
+    }
+    if (record_urcs) {
+        writer_append(w, ",\"URC\"", 6);
+    }
+    writer_append(w, "\n", 1);
+    *offset = w->len;
+    return writer_flush(w);
+}
+
+// Function to build the name of a data file from the current date and time
+// The output folder is created if it doesn't exist. With several devices the
+// label of the device follows "modem_data_".
+int format_output_filename(char *filename, size_t max_len, const char *output_folder, const char *label, const char *extension) {
+    time_t now = time(NULL);
+    struct tm *t = localtime(&now);
+
+    // Create output folder if it doesn't exist
+    struct stat st = {0};
+    if (stat(output_folder, &st) == -1) {
+        if (mkdir(output_folder, 0700) != 0) {
+            perror("Error creating output folder");
+            return -1;
+        }
+    }
+
+    // Format the filename based on the current date and time
+    char stamp[160];
+    snprintf(stamp, sizeof(stamp), "%s%s%04d-%02d-%02d_%02d-%02d-%02d",
+             label ? label : "", label ? "_" : "",
+             t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+             t->tm_hour, t->tm_min, t->tm_sec);
+    snprintf(filename, max_len, "%s/modem_data_%s.%s", output_folder, stamp, extension);
+
+    // Segments rotated within the same second get a sequence number
+    for (int seq = 1; access(filename, F_OK) == 0; seq++) {
+        snprintf(filename, max_len, "%s/modem_data_%s_%d.%s", output_folder, stamp, seq, extension);
+    }
+    return 0;
+}
+
+// Function to create a binary data file with its header and command dictionary
+int create_binary_file(struct file_writer *w, char *commands[], int count, int record_urcs, const char *output_folder, const char *label, const struct writer_policy *policy, char *filename, uint64_t *offset) {
+    if (format_output_filename(filename, OUTPUT_PATH_MAX, output_folder, label, "bin") != 0) {
+        return -1;
+    }
+
+    if (writer_open(w, filename, policy) != 0) {
+        perror("Error creating binary file");
+        return -1;
+    }
+
+    // URC records use an extra "URC" entry after the commands
+    struct modem_bin_header header = { .version = MODEM_BIN_VERSION, .command_count = count + (record_urcs ? 1 : 0) };
+    memcpy(header.magic, MODEM_BIN_MAGIC, sizeof(header.magic));
+    writer_append(w, &header, sizeof(header));
+    *offset = sizeof(header);
+
+    // Command dictionary: records refer to commands by their index
+    for (int i = 0; i < count; i++) {
+        uint16_t len = strlen(commands[i]);
+        writer_append(w, &len, sizeof(len));
+        writer_append(w, commands[i], len);
+        *offset += sizeof(len) + len;
+    }
+    if (record_urcs) {
+        uint16_t len = 3;
+        writer_append(w, &len, sizeof(len));
+        writer_append(w, "URC", len);
+        *offset += sizeof(len) + len;
+    }
+
+    if (writer_flush(w) != 0) {
+        perror("Error writing binary file header");
+        writer_close(w);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to open the data file in the configured format
+int output_open(struct output_sink *out, int format, char *commands[], const unsigned char on_change[], int count, const char *output_folder, const char *label, const struct writer_policy *policy, const struct rotation_policy *rotation, struct compressor *compressor, int keyframe_interval_ms, int command_timestamps, int record_urcs) {
+    memset(out, 0, sizeof(*out));
+    out->format = format;
+    out->commands = commands;
+    out->count = count;
+    out->output_folder = output_folder;
+    out->label = label;
+    out->compressor = compressor;
+    out->policy = *policy;
+    out->rotation = *rotation;
+    out->on_change = on_change;
+    out->command_timestamps = command_timestamps;
+    out->record_urcs = record_urcs;
+    out->stamp_cache.second = -1;
+    out->keyframe_interval_ns = (long long)keyframe_interval_ms * 1000000LL;
+
+    out->last_hash = calloc(count, sizeof(out->last_hash[0]));
+    out->emit = calloc(count, 1);
+    if (out->last_hash == NULL || out->emit == NULL) {
+        perror("Error allocating memory for change tracking");
+        free(out->last_hash);
+        free(out->emit);
+        return -1;
+    }
+
+    // Binary files keep the raw responses; the decoder gets the full text
+    out->parsers = calloc(count, sizeof(out->parsers[0]));
+    if (out->parsers == NULL) {
+        perror("Error allocating memory for response parsers");
+        return -1;
+    }
+    if (format == OUTPUT_CSV) {
+        for (int i = 0; i < count; i++) {
+            out->parsers[i] = find_response_parser(commands[i]);
+        }
+    }
+
+    // Fixed size, so a long segment never grows it on the writer thread
+    out->index = malloc(BINARY_INDEX_MAX * sizeof(out->index[0]));
+    if (out->index == NULL) {
+        perror("Error allocating memory for the offset index");
+        return -1;
+    }
+
+    return output_open_segment(out);
+}
+
+// Function to start a new segment of the data file
+int output_open_segment(struct output_sink *out) {
+    int result;
+
+    out->offset = 0;
+    out->index_len = 0;
+    out->index_stride = BINARY_INDEX_STRIDE;
+    out->index_fd = -1;
+    out->segment_rows = 0;
+    if (out->format == OUTPUT_BINARY) {
+        result = create_binary_file(&out->writer, out->commands, out->count, out->record_urcs, out->output_folder, out->label, &out->policy, out->filename, &out->offset);
+    } else {
+        result = create_csv_file(&out->writer, out->commands, out->parsers, out->count, out->command_timestamps, out->record_urcs, out->output_folder, out->label, &out->policy, out->filename, &out->offset);
+    }
+    if (result != 0 || (out->format == OUTPUT_CSV && csv_index_open(out) != 0)) {
+        return -1;
+    }
+
+    out->segments++;
+    out->next_keyframe_ns = 0; // Every segment starts with a keyframe
+    out->segment_end = next_rotation_boundary(time(NULL), out->rotation.period);
+    return 0;
+}
+
+// Function to get the first hour or day boundary after now (local time)
+time_t next_rotation_boundary(time_t now, int period) {
+    if (period == ROTATE_NONE) {
+        return 0;
+    }
+
+    struct tm t;
+    localtime_r(&now, &t);
+    t.tm_min = 0;
+    t.tm_sec = 0;
+    if (period == ROTATE_HOURLY) {
+        t.tm_hour++;
+    } else {
+        t.tm_hour = 0;
+        t.tm_mday++;
+    }
+    t.tm_isdst = -1; // Let mktime() work out daylight saving time
+    return mktime(&t);
+}
+
+// Function to close the current segment and start the next one
+// The finished segment is queued for background compression.
+int output_rotate(struct output_sink *out) {
+    char finished[OUTPUT_PATH_MAX];
+
+    snprintf(finished, sizeof(finished), "%s", out->filename);
+    output_close_segment(out);
+    if (out->compressor != NULL) {
+        compressor_submit(out->compressor, finished);
+    }
+    return output_open_segment(out);
+}
+
+// Function to write the samples of one cycle to the data file
+void output_write_cycle(struct output_sink *out, struct cycle_state *cycle, int count) {
+    int result;
+
+    // Start a new segment once the size limit or a wall-clock boundary is reached
+    if ((out->rotation.max_bytes > 0 && out->offset >= (uint64_t)out->rotation.max_bytes) ||
+        (out->segment_end != 0 && cycle->timestamp_ns / 1000000000LL >= out->segment_end)) {
+        if (output_rotate(out) != 0) {
+            fprintf(stderr, "Error rotating data file\n");
+            return;
+        }
+    }
+
+    select_changed_responses(out, cycle, count);
+    if (out->format == OUTPUT_BINARY) {
+        result = write_binary_records(out, cycle, count);
+    } else {
+        result = write_csv_row(out, cycle, count);
+    }
+    if (result != 0) {
+        perror("Error writing data file");
+    }
+    if (out->format == OUTPUT_CSV) {
+        csv_index_write(out);
+    }
+    out->cycle++;
+}
+
+// Function to write one cycle as a CSV row
+int write_csv_row(struct output_sink *out, struct cycle_state *cycle, int count) {
+    struct response_buf *row = &cycle->row;
+
+    // Index every CSV_INDEX_STRIDE-th row of the segment
+    if (out->segment_rows++ % CSV_INDEX_STRIDE == 0) {
+        csv_index_append(out, cycle->timestamp_ns);
+    }
+
+    row->len = 0;
+    response_append(row, "\"", 1);
+    response_append(row, cycle->timestamp, strlen(cycle->timestamp));
+    response_append(row, "\"", 1);
+
+    for (int i = 0; i < count; i++) {
+        const struct response_parser *parser = out->parsers[i];
+        const struct response_buf *resp = &cycle->responses[i];
+
+        if (parser == NULL) {
+            // Commands that were not due leave their cell empty
+            response_append(row, ",", 1);
+            if (out->emit[i]) {
+                csv_append_raw_response(row, resp->data, resp->len);
+            }
+        } else {
+            // Typed columns stay empty when not due, failed or not understood
+            int values[FIELD_MAX];
+            int parsed = out->emit[i] && !(cycle->due[i] && cycle->infos[i].error) &&
+                         parser->parse(parser, resp->data, resp->len, values) == 0;
+            for (int f = 0; f < parser->field_count; f++) {
+                char cell[16];
+                int len = 1;
+                cell[0] = ',';
+                if (parsed && values[f] != FIELD_MISSING) {
+                    len = snprintf(cell, sizeof(cell), ",%d", values[f]);
+                }
+                response_append(row, cell, len);
+            }
+        }
+
+        // Only fresh samples have timing; keyframe copies leave it empty
+        if (out->command_timestamps) {
+            char cell[48];
+            int len = 2;
+            memcpy(cell, ",,", 2);
+            if (out->emit[i] && cycle->due[i] && cycle->infos[i].sent_ns) {
+                len = snprintf(cell, sizeof(cell), ",%lld,%lld", cycle->infos[i].sent_ns, cycle->infos[i].received_ns);
+            }
+            response_append(row, cell, len);
+        }
+    }
+
+    // URCs as "<time> <text>" lines in one cell, stray lines as "<time> [stray] <text>"
+    if (out->record_urcs) {
+        response_append(row, ",", 1);
+        if (cycle->urc_count > 0) {
+            response_append(row, "\"", 1);
+            for (int u = 0; u < cycle->urc_count; u++) {
+                char stamp[32];
+                int len = format_timestamp(&out->stamp_cache, cycle->urcs[u].timestamp_ns, stamp);
+                if (u > 0) {
+                    response_append(row, "\n", 1);
+                }
+                response_append(row, stamp, len);
+                response_append(row, " ", 1);
+                if (cycle->urcs[u].stray) {
+                    response_append(row, "[stray] ", 8);
+                }
+                for (const char *c = cycle->urcs[u].text; *c; c++) {
+                    response_append(row, c, 1);
+                    if (*c == '"') {
+                        response_append(row, "\"", 1);
+                    }
+                }
+            }
+            response_append(row, "\"", 1);
+        }
+    }
+
+    // Finish the row and hand it to the writer in one go
+    response_append(row, "\n", 1);
+    if (writer_append(&out->writer, row->data, row->len) != 0) {
+        return -1;
+    }
+    out->offset += row->len;
+    return writer_end_row(&out->writer);
+}
+
+// Function to create the sidecar index of a CSV segment (<file>.idx)
+// The index maps the timestamp of every CSV_INDEX_STRIDE-th row to its byte
+// offset, so modem_query can seek straight to a time range of an uncompressed
+// segment.
+int csv_index_open(struct output_sink *out) {
+    char filename[OUTPUT_PATH_MAX + 8];
+    snprintf(filename, sizeof(filename), "%s.idx", out->filename);
+
+    out->index_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out->index_fd < 0) {
+        perror("Error creating CSV index file");
+        return -1;
+    }
+
+    struct modem_csv_index_header header = { .version = MODEM_CSV_INDEX_VERSION, .stride = CSV_INDEX_STRIDE };
+    memcpy(header.magic, MODEM_CSV_INDEX_MAGIC, sizeof(header.magic));
+    if (write(out->index_fd, &header, sizeof(header)) != sizeof(header)) {
+        perror("Error writing CSV index file");
+        close(out->index_fd);
+        out->index_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to add the row about to be written to the sidecar index
+// The entry waits in out->index until the row has reached the data file, see
+// csv_index_write(). The data buffer holds far fewer than BINARY_INDEX_MAX
+// strides of rows; should it fill up anyway, the entry is left out.
+int csv_index_append(struct output_sink *out, long long timestamp_ns) {
+    if (out->index_fd < 0 || out->index_len == BINARY_INDEX_MAX) {
+        return 0;
+    }
+
+    struct modem_bin_index_entry entry = { .timestamp_ns = timestamp_ns, .offset = out->offset };
+    out->index[out->index_len++] = entry;
+    return 0;
+}
+
+// Function to append the entries of flushed rows to the sidecar index
+// An entry is only written once the data file holds its row (is synced past it
+// with an fsync policy), so after a crash the index never points past the end
+// of the data file.
+int csv_index_write(struct output_sink *out) {
+    struct file_writer *w = &out->writer;
+    uint64_t written = w->policy.fsync_mode == FSYNC_NONE ? w->flushed : w->synced;
+    size_t ready = 0;
+    while (ready < out->index_len && out->index[ready].offset < written) {
+        ready++;
+    }
+    if (out->index_fd < 0 || ready == 0) {
+        return 0;
+    }
+
+    size_t len = ready * sizeof(out->index[0]);
+    long long start = monotonic_us();
+    ssize_t n = write(out->index_fd, out->index, len);
+    io_histogram_add(&io_stats.file_write_latency, monotonic_us() - start);
+    STAT_ADD(io_stats.file_writes, 1);
+    out->index_len -= ready;
+    memmove(out->index, out->index + ready, out->index_len * sizeof(out->index[0]));
+    if (n != (ssize_t)len) {
+        perror("Error writing CSV index file");
+        return -1;
+    }
+    STAT_ADD(io_stats.file_write_bytes, n);
+    return 0;
+}
+
+// Function to append a quoted CSV cell, doubling embedded quotes
+int csv_append_quoted(struct response_buf *row, const char *text, size_t len) {
+    if (response_append(row, "\"", 1) != 0) {
+        return -1;
+    }
+    while (len > 0) {
+        const char *quote = memchr(text, '"', len);
+        size_t chunk = quote ? (size_t)(quote - text) + 1 : len;
+        if (response_append(row, text, chunk) != 0 ||
+            (quote && response_append(row, "\"", 1) != 0)) {
+            return -1;
+        }
+        text += chunk;
+        len -= chunk;
+    }
+    return response_append(row, "\"", 1);
+}
+
+// Function to append a response without a parser as one quoted cell
+// The echoed command, blank lines and the final OK are dropped and the
+// remaining lines are joined with '\n'; errors are kept.
+int csv_append_raw_response(struct response_buf *row, const char *data, size_t len) {
+    const char *end = data + len;
+    int lines = 0;
+
+    if (response_append(row, "\"", 1) != 0) {
+        return -1;
+    }
+    while (data < end) {
+        const char *nl = memchr(data, '\n', end - data);
+        const char *next = nl ? nl + 1 : end;
+        size_t text_len = strcspn(data, "\r\n");
+        if (text_len > (size_t)(next - data)) {
+            text_len = next - data;
+        }
+
+        int keep = text_len > 0 && strncasecmp(data, "AT", 2) != 0 &&
+                   !(text_len == 2 && strncmp(data, "OK", 2) == 0);
+        if (keep) {
+            if (lines++ > 0 && response_append(row, "\n", 1) != 0) {
+                return -1;
+            }
+            for (size_t i = 0; i < text_len; i++) {
+                if (response_append(row, &data[i], 1) != 0 ||
+                    (data[i] == '"' && response_append(row, "\"", 1) != 0)) {
+                    return -1;
+                }
+            }
+        }
+        data = next;
+    }
+    return response_append(row, "\"", 1);
+}
+
+// Column names of the response parsers
+static const char *const csq_fields[] = { "rssi", "ber" };
+static const char *const registration_fields[] = { "n", "stat" };
+static const char *const servingcell_fields[] = { "lte_rsrp", "lte_rsrq", "lte_sinr", "nr_rsrp", "nr_rsrq", "nr_sinr" };
+static const char *const temperature_fields[] = { "max" };
+
+// Parser registry, looked up by command when the data file is opened
+static const struct response_parser response_parsers[] = {
+    { "AT+CSQ", "+CSQ", csq_fields, 2, parse_leading_ints },
+    { "AT+CREG?", "+CREG", registration_fields, 2, parse_leading_ints },
+    { "AT+CGREG?", "+CGREG", registration_fields, 2, parse_leading_ints },
+    { "AT+CEREG?", "+CEREG", registration_fields, 2, parse_leading_ints },
+    { "AT+C5GREG?", "+C5GREG", registration_fields, 2, parse_leading_ints },
+    { "AT+QENG=\"servingcell\"", "+QENG", servingcell_fields, 6, parse_servingcell },
+    { "AT+QTEMP", "+QTEMP", temperature_fields, 1, parse_max_temperature },
+};
+
+// Function to find the parser of a command, NULL if its response is kept as text
+const struct response_parser *find_response_parser(const char *command) {
+    for (size_t i = 0; i < sizeof(response_parsers) / sizeof(response_parsers[0]); i++) {
+        if (strcasecmp(command, response_parsers[i].command) == 0) {
+            return &response_parsers[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to find the next information line starting with "prefix:"
+// *line and *len get the text after the colon; *pos moves past the line.
+// Returns 1 if a line was found and 0 at the end of the response.
+int next_information_line(const char **pos, const char *end, const char *prefix, const char **line, size_t *len) {
+    size_t plen = strlen(prefix);
+
+    while (*pos < end) {
+        const char *start = *pos;
+        const char *nl = memchr(start, '\n', end - start);
+        *pos = nl ? nl + 1 : end;
+
+        size_t text_len = strcspn(start, "\r\n");
+        if (text_len > (size_t)(*pos - start)) {
+            text_len = *pos - start;
+        }
+        if (text_len > plen && strncasecmp(start, prefix, plen) == 0 && start[plen] == ':') {
+            *line = start + plen + 1;
+            *len = text_len - plen - 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to split an information line into comma-separated values
+// Surrounding spaces and double quotes are removed. Returns the number of values.
+int split_fields(const char *line, size_t len, struct field_token tokens[], int max) {
+    const char *end = line + len;
+    int n = 0;
+
+    while (n < max) {
+        const char *comma = memchr(line, ',', end - line);
+        const char *stop = comma ? comma : end;
+        const char *a = line, *b = stop;
+
+        while (a < b && isspace((unsigned char)*a)) a++;
+        while (b > a && isspace((unsigned char)b[-1])) b--;
+        if (b - a >= 2 && *a == '"' && b[-1] == '"') {
+            a++;
+            b--;
+        }
+        tokens[n].text = a;
+        tokens[n].len = b - a;
+        n++;
+
+        if (comma == NULL) {
+            break;
+        }
+        line = comma + 1;
+    }
+    return n;
+}
+
+// Function to read a decimal value
+// Returns 0 on success and -1 if the value is empty, "-" or not a number.
+int field_int(const struct field_token *token, int *value) {
+    char buf[16];
+    char *end;
+
+    if (token->len == 0 || token->len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, token->text, token->len);
+    buf[token->len] = '\0';
+
+    long v = strtol(buf, &end, 10);
+    if (end == buf || *end != '\0' || v <= INT_MIN || v > INT_MAX) {
+        return -1;
+    }
+    *value = (int)v;
+    return 0;
+}
+
+// Function to parse the first values of a line: "+CSQ: 21,99", "+CREG: 0,1"
+int parse_leading_ints(const struct response_parser *parser, const char *data, size_t len, int values[]) {
+    struct field_token tokens[FIELD_MAX];
+    const char *pos = data;
+    const char *line;
+    size_t line_len;
+
+    if (!next_information_line(&pos, data + len, parser->prefix, &line, &line_len)) {
+        return -1;
+    }
+
+    int n = split_fields(line, line_len, tokens, parser->field_count);
+    for (int f = 0; f < parser->field_count; f++) {
+        if (f >= n || field_int(&tokens[f], &values[f]) != 0) {
+            values[f] = FIELD_MISSING;
+        }
+    }
+    return 0;
+}
+
+// Function to parse RSRP, RSRQ and SINR out of AT+QENG="servingcell"
+// LTE and NR5G-SA report a single "servingcell" line; EN-DC reports the
+// state line followed by separate "LTE" and "NR5G-NSA" lines.
+int parse_servingcell(const struct response_parser *parser, const char *data, size_t len, int values[]) {
+    struct field_token tokens[FIELD_TOKENS_MAX];
+    const char *pos = data;
+    const char *line;
+    size_t line_len;
+    int found = 0;
+
+    for (int f = 0; f < parser->field_count; f++) {
+        values[f] = FIELD_MISSING;
+    }
+
+    while (next_information_line(&pos, data + len, parser->prefix, &line, &line_len)) {
+        int n = split_fields(line, line_len, tokens, FIELD_TOKENS_MAX);
+        int rsrp = -1, rsrq = -1, sinr = -1; // Token positions
+        int *out = values;                   // LTE columns
+
+        // Drop the "servingcell",<state> lead-in so every layout starts with the RAT
+        struct field_token *t = tokens;
+        if (n >= 2 && t[0].len == 11 && strncasecmp(t[0].text, "servingcell", 11) == 0) {
+            t += 2;
+            n -= 2;
+        }
+        if (n < 1) {
+            continue;
+        }
+
+        if (t[0].len == 3 && strncasecmp(t[0].text, "LTE", 3) == 0) {
+            // "LTE",duplex,MCC,MNC,cellID,PCID,EARFCN,band,UL_bw,DL_bw,TAC,RSRP,RSRQ,RSSI,SINR
+            rsrp = 11, rsrq = 12, sinr = 14;
+        } else if (t[0].len == 7 && strncasecmp(t[0].text, "NR5G-SA", 7) == 0) {
+            // "NR5G-SA",duplex,MCC,MNC,cellID,PCID,TAC,ARFCN,band,DL_bw,RSRP,RSRQ,SINR
+            rsrp = 10, rsrq = 11, sinr = 12;
+            out = values + 3;
+        } else if (t[0].len == 8 && strncasecmp(t[0].text, "NR5G-NSA", 8) == 0) {
+            // "NR5G-NSA",MCC,MNC,PCID,RSRP,SINR,RSRQ
+            rsrp = 4, sinr = 5, rsrq = 6;
+            out = values + 3;
+        } else {
+            continue; // State only, or a RAT without these measurements
+        }
+
+        found = 1;
+        if (rsrp < n) field_int(&t[rsrp], &out[0]);
+        if (rsrq < n) field_int(&t[rsrq], &out[1]);
+        if (sinr < n) field_int(&t[sinr], &out[2]);
+    }
+    return found ? 0 : -1;
+}
+
+// Function to parse the hottest sensor out of AT+QTEMP
+// Every sensor is reported on its own line: +QTEMP: "name","33"
+int parse_max_temperature(const struct response_parser *parser, const char *data, size_t len, int values[]) {
+    struct field_token tokens[2];
+    const char *pos = data;
+    const char *line;
+    size_t line_len;
+
+    values[0] = FIELD_MISSING;
+    while (next_information_line(&pos, data + len, parser->prefix, &line, &line_len)) {
+        int celsius;
+        if (split_fields(line, line_len, tokens, 2) == 2 && field_int(&tokens[1], &celsius) == 0 &&
+            (values[0] == FIELD_MISSING || celsius > values[0])) {
+            values[0] = celsius;
+        }
+    }
+    return values[0] == FIELD_MISSING ? -1 : 0;
+}
+
+// Function to decide which responses of the cycle are written
+// Commands flagged on_change are left out while their response hashes the same
+// as the last recorded one. On keyframes every on-change command that has been
+// sampled is written again, so a reader can start at any keyframe.
+void select_changed_responses(struct output_sink *out, const struct cycle_state *cycle, int count) {
+    int keyframe = out->next_keyframe_ns == 0 || cycle->timestamp_ns >= out->next_keyframe_ns;
+    if (keyframe) {
+        out->next_keyframe_ns = cycle->timestamp_ns + out->keyframe_interval_ns;
+    }
+
+    for (int i = 0; i < count; i++) {
+        out->emit[i] = cycle->due[i];
+        if (!out->on_change[i]) {
+            continue;
+        }
+
+        if (cycle->due[i]) {
+            uint64_t hash = hash_response(cycle->responses[i].data, cycle->responses[i].len);
+            if (hash == out->last_hash[i] && !keyframe) {
+                out->emit[i] = 0;
+                out->unchanged++;
+            }
+            out->last_hash[i] = hash;
+        } else if (keyframe && out->last_hash[i] != 0) {
+            out->emit[i] = 1; // Repeat the latest value
+        }
+    }
+}
+
+// Function to hash a response (64-bit FNV-1a), never 0 so 0 means "none yet"
+uint64_t hash_response(const char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+// Function to write one cycle as binary records, one per sampled command
+int write_binary_records(struct output_sink *out, const struct cycle_state *cycle, int count) {
+    // Index every index_stride-th cycle; when the index is full every other
+    // entry is dropped and the stride doubles, so its size stays bounded
+    if (out->cycle % out->index_stride == 0) {
+        if (out->index_len == BINARY_INDEX_MAX) {
+            for (size_t e = 0; e < BINARY_INDEX_MAX / 2; e++) {
+                out->index[e] = out->index[2 * e];
+            }
+            out->index_len = BINARY_INDEX_MAX / 2;
+            out->index_stride *= 2;
+        }
+    }
+    if (out->cycle % out->index_stride == 0) {
+        out->index[out->index_len].timestamp_ns = cycle->timestamp_ns;
+        out->index[out->index_len].offset = out->offset;
+        out->index_len++;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!out->emit[i]) {
+            continue;
+        }
+
+        const struct response_buf *resp = &cycle->responses[i];
+        const struct response_info *info = &cycle->infos[i];
+        struct modem_bin_record record = {
+            .timestamp_ns = cycle->timestamp_ns,
+            .sent_ns = cycle->due[i] ? info->sent_ns : 0,
+            .received_ns = cycle->due[i] ? info->received_ns : 0,
+            .cycle = out->cycle,
+            .length = resp->len,
+            .command_id = i,
+            .flags = !cycle->due[i] ? MODEM_BIN_FLAG_REPEAT :
+                     (!info->complete || info->error) ? MODEM_BIN_FLAG_ERROR : 0,
+        };
+
+        if (writer_append(&out->writer, &record, sizeof(record)) != 0 ||
+            writer_append(&out->writer, resp->data, resp->len) != 0) {
+            return -1;
+        }
+        out->offset += sizeof(record) + resp->len;
+    }
+
+    // One record per URC, with its arrival time in received_ns
+    for (int u = 0; out->record_urcs && u < cycle->urc_count; u++) {
+        const struct urc_event *event = &cycle->urcs[u];
+        struct modem_bin_record record = {
+            .timestamp_ns = cycle->timestamp_ns,
+            .received_ns = event->timestamp_ns,
+            .cycle = out->cycle,
+            .length = strlen(event->text),
+            .command_id = count,
+            .flags = MODEM_BIN_FLAG_URC | (event->stray ? MODEM_BIN_FLAG_STRAY : 0),
+        };
+        if (writer_append(&out->writer, &record, sizeof(record)) != 0 ||
+            writer_append(&out->writer, event->text, record.length) != 0) {
+            return -1;
+        }
+        out->offset += sizeof(record) + record.length;
+    }
+    return writer_end_row(&out->writer);
+}
+
+// Function to close the current segment
+// Binary files get their offset index and footer appended here.
+void output_close_segment(struct output_sink *out) {
+    if (out->format == OUTPUT_BINARY) {
+        struct modem_bin_footer footer = { .index_offset = out->offset, .index_count = out->index_len };
+        memcpy(footer.magic, MODEM_BIN_FOOTER_MAGIC, sizeof(footer.magic));
+        if (out->index_len > 0) {
+            writer_append(&out->writer, out->index, out->index_len * sizeof(out->index[0]));
+        }
+        writer_append(&out->writer, &footer, sizeof(footer));
+    }
+
+    if (writer_close(&out->writer) != 0) {
+        perror("Error closing data file");
+    }
+    if (out->index_fd >= 0) {
+        csv_index_write(out);
+        close(out->index_fd);
+        out->index_fd = -1;
+    }
+}
+
+// Function to close the data file
+// Segments still queued for compression are left to compressor_stop().
+void output_close(struct output_sink *out) {
+    output_close_segment(out);
+    free(out->writer.buf);
+    free(out->index);
+    free(out->parsers);
+    free(out->last_hash);
+    free(out->emit);
+    out->last_hash = NULL;
+    out->emit = NULL;
+    out->writer.buf = NULL;
+    out->index = NULL;
+    out->parsers = NULL;
+}
+
+// Function to start the compression thread
+int compressor_start(struct compressor *c) {
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wake, NULL);
+    c->head = c->count = 0;
+    c->stopping = 0;
+
+    int err = start_thread(&c->thread, compressor_main, c);
+    if (err != 0) {
+        fprintf(stderr, "Error starting compression thread: %s\n", strerror(err));
+        return -1;
+    }
+    c->started = 1;
+    return 0;
+}
+
+// Function to queue a finished segment for compression
+// Never blocks: if the worker is too far behind the segment stays uncompressed.
+void compressor_submit(struct compressor *c, const char *path) {
+    pthread_mutex_lock(&c->lock);
+    if (c->count == COMPRESS_QUEUE_SIZE) {
+        c->dropped++;
+        fprintf(stderr, "Compression queue full, leaving '%s' uncompressed\n", path);
+    } else {
+        int slot = (c->head + c->count) % COMPRESS_QUEUE_SIZE;
+        snprintf(c->paths[slot], sizeof(c->paths[slot]), "%s", path);
+        c->count++;
+        pthread_cond_signal(&c->wake);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Function to finish the queued work and stop the compression thread
+void compressor_stop(struct compressor *c) {
+    if (!c->started) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->stopping = 1;
+    pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+
+    pthread_join(c->thread, NULL);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->wake);
+    c->started = 0;
+}
+
+// Compression thread: gzip queued segments at the lowest priority
+void *compressor_main(void *arg) {
+    struct compressor *c = arg;
+
+    // Only use CPU time nobody else wants
+    struct sched_param param = { .sched_priority = 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+
+    pthread_mutex_lock(&c->lock);
+    while (1) {
+        while (c->count == 0 && !c->stopping) {
+            pthread_cond_wait(&c->wake, &c->lock);
+        }
+        if (c->count == 0) {
+            break; // Stopping and nothing left to do
+        }
+
+        char path[OUTPUT_PATH_MAX];
+        snprintf(path, sizeof(path), "%s", c->paths[c->head]);
+        c->head = (c->head + 1) % COMPRESS_QUEUE_SIZE;
+        c->count--;
+        pthread_mutex_unlock(&c->lock);
+
+        int result = compress_file(path);
+
+        pthread_mutex_lock(&c->lock);
+        if (result == 0) {
+            c->compressed++;
+        } else {
+            c->failed++;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+// Function to replace a file with its gzip-compressed version (path.gz)
+// The output is written under a temporary name and renamed when complete, so
+// an interrupted compression never leaves a truncated .gz behind.
+int compress_file(const char *path) {
+    char target[OUTPUT_PATH_MAX + 8];
+    char temp[OUTPUT_PATH_MAX + 16];
+    char buf[65536];
+
+    snprintf(target, sizeof(target), "%s.gz", path);
+    snprintf(temp, sizeof(temp), "%s.gz.tmp", path);
+
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        perror("Error opening segment for compression");
+        return -1;
+    }
+
+    gzFile gz = gzopen(temp, "wb6");
+    if (gz == NULL) {
+        fprintf(stderr, "Error creating '%s'\n", temp);
+        close(in);
+        return -1;
+    }
+
+    ssize_t n;
+    int result = 0;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (gzwrite(gz, buf, (unsigned)n) != n) {
+            result = -1;
+            break;
+        }
+    }
+    if (n < 0) {
+        result = -1;
+    }
+    close(in);
+
+    if (gzclose(gz) != Z_OK) {
+        result = -1;
+    }
+    if (result != 0 || rename(temp, target) != 0) {
+        fprintf(stderr, "Error compressing '%s'\n", path);
+        unlink(temp);
+        return -1;
+    }
 
-                if (count >= max_count) {
-                    break; // Stop if we reach the maximum number of commands
+    unlink(path);
+    return 0;
+}
+
+// Function to open a data file for buffered writing
+// The buffer and the counters are kept when the writer moves on to the next
+// segment of a rotated file; the writer must start out zeroed.
+int writer_open(struct file_writer *w, const char *filename, const struct writer_policy *policy) {
+    w->policy = *policy;
+    w->len = 0;
+    w->rows_pending = 0;
+    w->unsynced_ms = 0;
+    w->flushed = w->synced = 0;
+
+    if (w->buf == NULL) {
+        w->buf = malloc(WRITER_BUFFER_SIZE);
+        if (w->buf == NULL) {
+            return -1;
+        }
+        w->cap = WRITER_BUFFER_SIZE;
+    }
+
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Function to buffer bytes for the data file
+// The buffer is flushed early only if the data doesn't fit.
+int writer_append(struct file_writer *w, const void *data, size_t len) {
+    if (w->len + len > w->cap && writer_flush(w) != 0) {
+        return -1;
+    }
+
+    // Larger than the whole buffer: write it straight through
+    if (len > w->cap) {
+        const char *p = data;
+        while (len > 0) {
+            long long start = monotonic_us();
+            ssize_t n = write(w->fd, p, len);
+            io_histogram_add(&io_stats.file_write_latency, monotonic_us() - start);
+            STAT_ADD(io_stats.file_writes, 1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
                 }
+                return -1;
             }
+            w->writes++;
+            w->bytes += n;
+            w->flushed += n;
+            STAT_ADD(io_stats.file_write_bytes, n);
+            p += n;
+            len -= n;
+        }
+        return 0;
+    }
 
-            // Clear the command buffer for the next line
-            memset(command_buffer, 0, sizeof(command_buffer));
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    return 0;
+}
+
+// Function to mark the end of a row and apply the flush and fsync policies
+int writer_end_row(struct file_writer *w) {
+    long long now = monotonic_ms();
+
+    if (w->rows_pending++ == 0) {
+        w->first_pending_ms = now;
+    }
+
+    int flush = w->policy.flush_mode == FLUSH_ROW ||
+                (w->policy.flush_mode == FLUSH_ROWS && w->rows_pending >= w->policy.flush_rows) ||
+                (w->policy.flush_mode == FLUSH_INTERVAL && now - w->first_pending_ms >= w->policy.flush_interval_ms);
+    if (flush && writer_flush(w) != 0) {
+        return -1;
+    }
+
+    // Group commit: one fsync covers every flush of the window
+    if (w->policy.fsync_mode == FSYNC_GROUP && w->unsynced_ms && now - w->unsynced_ms >= w->policy.fsync_interval_ms) {
+        return writer_sync(w);
+    }
+    return 0;
+}
+
+// Function to hand the buffered bytes to the kernel
+int writer_flush(struct file_writer *w) {
+    size_t done = 0;
+
+    while (done < w->len) {
+        long long start = monotonic_us();
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        io_histogram_add(&io_stats.file_write_latency, monotonic_us() - start);
+        STAT_ADD(io_stats.file_writes, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Keep what could not be written for the next attempt
+            memmove(w->buf, w->buf + done, w->len - done);
+            w->len -= done;
+            return -1;
         }
+        w->writes++;
+        w->bytes += n;
+        w->flushed += n;
+        STAT_ADD(io_stats.file_write_bytes, n);
+        done += n;
     }
 
-    fclose(file);
-    return count;
+    int flushed = w->len > 0 || w->rows_pending > 0;
+    w->len = 0;
+    w->rows_pending = 0;
+    if (!flushed) {
+        return 0;
+    }
+
+    if (w->policy.fsync_mode == FSYNC_FLUSH) {
+        return writer_sync(w);
+    }
+    if (w->unsynced_ms == 0) {
+        w->unsynced_ms = monotonic_ms();
+    }
+    return 0;
 }
 
-// Function to convert string to lowercase
-void to_lowercase(char *str) {
-    for (char *p = str; *p; p++) {
-        *p = tolower((unsigned char)*p);
+// Function to make the flushed bytes durable
+int writer_sync(struct file_writer *w) {
+    long long start = monotonic_us();
+    int result = fsync(w->fd);
+    long long elapsed = monotonic_us() - start;
+
+    w->fsyncs++;
+    STAT_ADD(io_stats.fsyncs, 1);
+    w->fsync_total_us += elapsed;
+    if (elapsed > w->fsync_max_us) {
+        w->fsync_max_us = elapsed;
     }
+    w->unsynced_ms = 0;
+    if (result == 0) {
+        w->synced = w->flushed;
+    }
+    return result;
 }
 
-// Function to trim whitespace from the start and end of a string
-void trim_whitespace(char *str) {
-    char *end;
+// Function to apply the time-based policies before the loop sleeps
+// If the loop will be idle past a flush or fsync deadline, that work is done
+// now, so the loss window stays bounded even between sparse samples.
+int writer_idle(struct file_writer *w, long long idle_ms) {
+    long long now = monotonic_ms();
 
-    // Trim leading space
-    while (isspace((unsigned char)*str)) str++;
+    if (w->policy.flush_mode == FLUSH_INTERVAL && w->rows_pending > 0 &&
+        now + idle_ms - w->first_pending_ms >= w->policy.flush_interval_ms) {
+        if (writer_flush(w) != 0) {
+            return -1;
+        }
+    }
+    if (w->policy.fsync_mode == FSYNC_GROUP && w->unsynced_ms &&
+        now + idle_ms - w->unsynced_ms >= w->policy.fsync_interval_ms) {
+        return writer_sync(w);
+    }
+    return 0;
+}
 
-    if (*str == 0)  // All spaces?
-        return;
+// Function to get the time until the next flush or fsync deadline in milliseconds
+// Returns -1 if nothing is waiting to be flushed or synced.
+long long writer_deadline_ms(const struct file_writer *w) {
+    long long now = monotonic_ms();
+    long long deadline = -1;
 
-    // Trim trailing space
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
+    if (w->policy.flush_mode == FLUSH_INTERVAL && w->rows_pending > 0) {
+        deadline = w->first_pending_ms + w->policy.flush_interval_ms;
+    }
+    if (w->policy.fsync_mode == FSYNC_GROUP && w->unsynced_ms) {
+        long long sync = w->unsynced_ms + w->policy.fsync_interval_ms;
+        if (deadline < 0 || sync < deadline) {
+            deadline = sync;
+        }
+    }
+    if (deadline < 0) {
+        return -1;
+    }
+    return deadline > now ? deadline - now : 0;
+}
 
-    // Null terminate after the last non-space character
-    *(end + 1) = '\0';
+// Function to flush, sync and close the data file (the buffer is kept)
+int writer_close(struct file_writer *w) {
+    int result = writer_flush(w);
+    if (w->policy.fsync_mode != FSYNC_NONE && w->unsynced_ms && writer_sync(w) != 0) {
+        result = -1;
+    }
+    if (close(w->fd) != 0) {
+        result = -1;
+    }
+    w->fd = -1;
+    return result;
 }
 
-// Function to remove surrounding quotes from a string
-void remove_surrounding_quotes(char *str) {
-    size_t len = strlen(str);
-    if (len > 1 && str[0] == '\"' && str[len - 1] == '\"') {
-        // Shift the string to remove the quotes
-        memmove(str, str + 1, len - 1);
-        str[len - 2] = '\0';
+// Function to allocate the sample queue and start the writer thread
+// From here until sample_queue_stop() the data files belong to the writer thread.
+// The queue holds SAMPLE_QUEUE_SLOTS cycles, or two per device if that is more,
+// so a tick that samples every device at once fits.
+int sample_queue_init(struct sample_queue *q, struct arena *arena, int count, int device_count, struct output_sink *outs, struct live_ring *live) {
+    memset(q, 0, sizeof(*q));
+    q->count = count;
+    q->device_count = device_count;
+    q->outs = outs;
+    q->live = live;
+    q->size = SAMPLE_QUEUE_SLOTS;
+    while (q->size < 2 * (unsigned long)device_count) {
+        q->size *= 2;
+    }
+
+    q->cycles = calloc(device_count, sizeof(q->cycles[0]));
+    if (q->cycles == NULL) {
+        perror("Error allocating memory for sample queue");
+        return -1;
+    }
+    for (int d = 0; d < device_count; d++) {
+        if (cycle_state_init(&q->cycles[d], arena, count) != 0) {
+            sample_queue_free(q);
+            return -1;
+        }
+    }
+
+    q->slots = calloc(q->size, sizeof(q->slots[0]));
+    if (q->slots == NULL) {
+        perror("Error allocating memory for sample queue");
+        sample_queue_free(q);
+        return -1;
+    }
+    for (unsigned long s = 0; s < q->size; s++) {
+        struct sample_slot *slot = &q->slots[s];
+        slot->due = calloc(count ? count : 1, 1);
+        slot->infos = calloc(count ? count : 1, sizeof(slot->infos[0]));
+        slot->lengths = calloc(count ? count : 1, sizeof(slot->lengths[0]));
+        slot->data = malloc((size_t)(count ? count : 1) * SAMPLE_RESPONSE_MAX);
+        if (slot->due == NULL || slot->infos == NULL || slot->lengths == NULL || slot->data == NULL) {
+            perror("Error allocating memory for sample queue");
+            sample_queue_free(q);
+            return -1;
+        }
+    }
+
+    if (sem_init(&q->ready, 0, 0) != 0) {
+        perror("Error creating sample queue semaphore");
+        sample_queue_free(q);
+        return -1;
     }
+    int err = start_thread(&q->thread, writer_thread_main, q);
+    if (err != 0) {
+        fprintf(stderr, "Error starting writer thread: %s\n", strerror(err));
+        sem_destroy(&q->ready);
+        sample_queue_free(q);
+        return -1;
+    }
+    q->started = 1;
+    return 0;
 }
 
-// Function to create a CSV file with the current timestamp
-FILE *create_csv_file(char *commands[], int count, const char *output_folder) {
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
+// Function to queue a polled cycle for the writer thread (polling loop only)
+// Returns 0, or -1 if the queue was full and the cycle was dropped.
+int sample_queue_push(struct sample_queue *q, int device, const struct cycle_state *cycle) {
+    unsigned long head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&q->tail, memory_order_acquire);
 
-    // Create output folder if it doesn't exist
-    struct stat st = {0};
-    if (stat(output_folder, &st) == -1) {
-        if (mkdir(output_folder, 0700) != 0) {
-            perror("Error creating output folder");
-            return NULL;
+    if (head - tail == q->size) {
+        if (!q->behind) {
+            fprintf(stderr, "Writer thread is falling behind, dropping samples\n");
         }
+        q->behind = 1;
+        q->dropped++;
+        return -1;
     }
+    q->behind = 0;
 
-    // Format the filename based on the current date and time
-    char filename[256];
-    snprintf(filename, sizeof(filename), "%s/modem_data_%04d-%02d-%02d_%02d-%02d-%02d.csv",
-             output_folder,
-             t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-             t->tm_hour, t->tm_min, t->tm_sec);
+    // Copy the cycle into the free slot
+    struct sample_slot *slot = &q->slots[head & (q->size - 1)];
+    slot->device = device;
+    slot->timestamp_ns = cycle->timestamp_ns;
+    memcpy(slot->timestamp, cycle->timestamp, sizeof(slot->timestamp));
+    memcpy(slot->due, cycle->due, q->count);
+    memcpy(slot->infos, cycle->infos, q->count * sizeof(slot->infos[0]));
+    memcpy(slot->urcs, cycle->urcs, cycle->urc_count * sizeof(slot->urcs[0]));
+    slot->urc_count = cycle->urc_count;
+    slot->spill.len = 0;
+    for (int i = 0; i < q->count; i++) {
+        if (!cycle->due[i]) {
+            continue;
+        }
+        size_t len = cycle->responses[i].len;
+        if (len > SAMPLE_RESPONSE_MAX) {
+            // Grows like a response buffer: allocated once, then reused
+            if (response_append(&slot->spill, cycle->responses[i].data, len) == 0) {
+                slot->lengths[i] = len;
+                q->spilled++;
+                continue;
+            }
+            // Out of memory: keep what fits and mark the sample failed
+            len = SAMPLE_RESPONSE_MAX;
+            slot->infos[i].error = 1;
+            q->truncated++;
+        }
+        memcpy(slot->data + (size_t)i * SAMPLE_RESPONSE_MAX, cycle->responses[i].data, len);
+        slot->lengths[i] = len;
+    }
 
-    FILE *file = fopen(filename, "w");
-    if (file == NULL) {
-        perror("Error creating CSV file");
-        return NULL;
+    // Publish the slot, then wake the writer
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    sem_post(&q->ready);
+
+    q->queued++;
+    if (head + 1 - tail > q->max_depth) {
+        q->max_depth = head + 1 - tail;
     }
+    return 0;
+}
 
-    // Write the header row to the CSV file
-    fprintf(file, "Timestamp");
+// Writer thread: drain queued cycles into the data files
+// Between cycles it sleeps until the next flush or fsync deadline of any writer.
+void *writer_thread_main(void *arg) {
+    struct sample_queue *q = arg;
+
+    while (1) {
+        unsigned long tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+        if (tail == head) {
+            if (atomic_load(&q->stopping)) {
+                break; // Drained
+            }
+
+            long long wait_ms = -1;
+            for (int d = 0; d < q->device_count; d++) {
+                long long deadline = writer_deadline_ms(&q->outs[d].writer);
+                if (deadline >= 0 && (wait_ms < 0 || deadline < wait_ms)) {
+                    wait_ms = deadline;
+                }
+            }
+            int woken;
+            if (wait_ms < 0) {
+                woken = sem_wait(&q->ready) == 0;
+            } else {
+                struct timespec deadline;
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += wait_ms / 1000;
+                deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                woken = sem_clockwait(&q->ready, CLOCK_MONOTONIC, &deadline) == 0;
+            }
+            if (!woken && errno == ETIMEDOUT) {
+                for (int d = 0; d < q->device_count; d++) {
+                    writer_idle(&q->outs[d].writer, 0);
+                    if (q->outs[d].format == OUTPUT_CSV) {
+                        csv_index_write(&q->outs[d]);
+                    }
+                }
+            }
+            continue;
+        }
+
+        // Bring the writer's copy of the responses up to date
+        struct sample_slot *slot = &q->slots[tail & (q->size - 1)];
+        struct cycle_state *cycle = &q->cycles[slot->device];
+        struct output_sink *out = &q->outs[slot->device];
+        cycle->timestamp_ns = slot->timestamp_ns;
+        memcpy(cycle->timestamp, slot->timestamp, sizeof(cycle->timestamp));
+        memcpy(cycle->due, slot->due, q->count);
+        memcpy(cycle->infos, slot->infos, q->count * sizeof(cycle->infos[0]));
+        memcpy(cycle->urcs, slot->urcs, slot->urc_count * sizeof(cycle->urcs[0]));
+        cycle->urc_count = slot->urc_count;
+        size_t spill_pos = 0;
+        for (int i = 0; i < q->count; i++) {
+            if (!slot->due[i]) {
+                continue;
+            }
+            const char *data = slot->data + (size_t)i * SAMPLE_RESPONSE_MAX;
+            if (slot->lengths[i] > SAMPLE_RESPONSE_MAX) {
+                data = slot->spill.data + spill_pos;
+                spill_pos += slot->lengths[i];
+            }
+            cycle->responses[i].len = 0;
+            response_append(&cycle->responses[i], data, slot->lengths[i]);
+        }
+
+        // The slot is free again once copied
+        atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+        output_write_cycle(out, cycle, q->count);
+        if (q->live != NULL) {
+            live_ring_publish(q->live, slot->device, cycle);
+        }
+    }
+    return NULL;
+}
+
+// Function to create the shared-memory object of the live samples
+// A stale object left by an earlier run is replaced; readers still mapping it
+// see it stopped.
+int live_ring_open(struct live_ring *live, const char *name, char *commands[], int count, const struct modem_device *devices, int device_count) {
+    memset(live, 0, sizeof(*live));
+    live->name = name;
+    live->count = count;
+    live->parsers = calloc(count ? count : 1, sizeof(live->parsers[0]));
+    live->first_field = calloc(count ? count : 1, sizeof(live->first_field[0]));
+    if (live->parsers == NULL || live->first_field == NULL) {
+        perror("Error allocating memory for live samples");
+        live_ring_close(live);
+        return -1;
+    }
+
+    // Same values, and names, as the typed CSV columns
+    int field_count = 0;
+    for (int i = 0; i < count; i++) {
+        live->parsers[i] = find_response_parser(commands[i]);
+        live->first_field[i] = field_count;
+        field_count += live->parsers[i] ? live->parsers[i]->field_count : 0;
+    }
+    live->latest = malloc((size_t)device_count * (field_count ? field_count : 1) * sizeof(int32_t));
+    if (live->latest == NULL) {
+        perror("Error allocating memory for live samples");
+        live_ring_close(live);
+        return -1;
+    }
+    for (size_t v = 0; v < (size_t)device_count * field_count; v++) {
+        live->latest[v] = MODEM_SHM_MISSING;
+    }
+
+    // Slots start on a cache line
+    size_t slot_size = (sizeof(struct modem_shm_slot) + field_count * sizeof(int32_t) + 63) & ~(size_t)63;
+    size_t fields_offset = sizeof(struct modem_shm_header);
+    size_t devices_offset = (fields_offset + field_count * sizeof(struct modem_shm_field) + 63) & ~(size_t)63;
+    size_t slots_offset = devices_offset + device_count * sizeof(struct modem_shm_device);
+    live->size = slots_offset + (size_t)device_count * LIVE_RING_SLOTS * slot_size;
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        perror("Error creating shared memory for live samples");
+        live_ring_close(live);
+        return -1;
+    }
+    if (ftruncate(fd, live->size) != 0) {
+        perror("Error sizing shared memory for live samples");
+        close(fd);
+        shm_unlink(name);
+        live_ring_close(live);
+        return -1;
+    }
+    void *base = mmap(NULL, live->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("Error mapping shared memory for live samples");
+        shm_unlink(name);
+        live_ring_close(live);
+        return -1;
+    }
+    live->base = base;
+    live->header = base;
+    live->devices = (struct modem_shm_device *)(live->base + devices_offset);
+    live->slots = live->base + slots_offset;
+
+    // The object is zero-filled: no samples, every sequence even
+    struct modem_shm_field *fields = (struct modem_shm_field *)(live->base + fields_offset);
+    for (int i = 0; i < count; i++) {
+        for (int f = 0; live->parsers[i] != NULL && f < live->parsers[i]->field_count; f++) {
+            snprintf(fields[live->first_field[i] + f].name, MODEM_SHM_NAME_LEN, "%s %s",
+                     commands[i], live->parsers[i]->fields[f]);
+        }
+    }
+    for (int d = 0; d < device_count; d++) {
+        snprintf(live->devices[d].label, MODEM_SHM_NAME_LEN, "%s", devices[d].label);
+    }
+
+    struct modem_shm_header *header = live->header;
+    header->version = MODEM_SHM_VERSION;
+    header->field_count = field_count;
+    header->device_count = device_count;
+    header->slot_count = LIVE_RING_SLOTS;
+    header->slot_size = slot_size;
+    header->fields_offset = fields_offset;
+    header->devices_offset = devices_offset;
+    header->slots_offset = slots_offset;
+    header->size = live->size;
+    atomic_store(&header->running, 1);
+
+    // Readers check the magic, so it goes in last
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, MODEM_SHM_MAGIC, sizeof(header->magic));
+    return 0;
+}
+
+// Function to publish the parsed values of a cycle
+// Commands that were not due keep their previous values.
+void live_ring_publish(struct live_ring *live, int device, const struct cycle_state *cycle) {
+    int field_count = live->header->field_count;
+    int32_t *latest = live->latest + (size_t)device * field_count;
+
+    for (int i = 0; i < live->count; i++) {
+        const struct response_parser *parser = live->parsers[i];
+        if (parser == NULL || !cycle->due[i]) {
+            continue;
+        }
+        int values[FIELD_MAX];
+        int parsed = !cycle->infos[i].error &&
+                     parser->parse(parser, cycle->responses[i].data, cycle->responses[i].len, values) == 0;
+        for (int f = 0; f < parser->field_count; f++) {
+            latest[live->first_field[i] + f] = parsed ? values[f] : MODEM_SHM_MISSING;
+        }
+    }
+
+    // Sequence lock: odd while the slot is rewritten
+    struct modem_shm_device *dev = &live->devices[device];
+    uint64_t n = atomic_load_explicit(&dev->head, memory_order_relaxed);
+    struct modem_shm_slot *slot = (struct modem_shm_slot *)(live->slots +
+        ((size_t)device * LIVE_RING_SLOTS + (n & (LIVE_RING_SLOTS - 1))) * live->header->slot_size);
+    uint32_t sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->sample = n;
+    slot->timestamp_ns = cycle->timestamp_ns;
+    memcpy(slot + 1, latest, field_count * sizeof(int32_t));
+    atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+    atomic_store_explicit(&dev->head, n + 1, memory_order_release);
+}
+
+// Function to mark the live samples stopped and remove the object
+void live_ring_close(struct live_ring *live) {
+    if (live->base != NULL) {
+        atomic_store(&live->header->running, 0);
+        munmap(live->base, live->size);
+        shm_unlink(live->name);
+    }
+    free(live->parsers);
+    free(live->first_field);
+    free(live->latest);
+    live->base = NULL;
+    live->parsers = NULL;
+    live->first_field = NULL;
+    live->latest = NULL;
+}
+
+// Function to let the writer thread drain the queue and stop it
+void sample_queue_stop(struct sample_queue *q) {
+    if (!q->started) {
+        return;
+    }
+    atomic_store(&q->stopping, 1);
+    sem_post(&q->ready);
+    pthread_join(q->thread, NULL);
+    sem_destroy(&q->ready);
+    q->started = 0;
+}
+
+// Function to release the sample queue
+void sample_queue_free(struct sample_queue *q) {
+    for (unsigned long s = 0; q->slots != NULL && s < q->size; s++) {
+        free(q->slots[s].due);
+        free(q->slots[s].infos);
+        free(q->slots[s].lengths);
+        free(q->slots[s].data);
+        if (q->slots[s].spill.heap) {
+            free(q->slots[s].spill.data);
+        }
+    }
+    free(q->slots);
+    q->slots = NULL;
+    for (int d = 0; q->cycles != NULL && d < q->device_count; d++) {
+        if (q->cycles[d].responses != NULL) {
+            cycle_state_free(&q->cycles[d], q->count);
+        }
+    }
+    free(q->cycles);
+    q->cycles = NULL;
+}
+
+// Function to set up the console output
+// The dashboard needs a terminal; on anything else the monitor runs quietly.
+int console_init(struct console *console, int mode, int refresh_ms, int count, int device_count) {
+    memset(console, 0, sizeof(*console));
+    console->mode = mode;
+    console->refresh_ms = refresh_ms;
+    console->device_count = device_count;
+    if (mode != CONSOLE_DASHBOARD) {
+        return 0;
+    }
+    if (!isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Standard output is not a terminal, running without the dashboard\n");
+        console->mode = CONSOLE_QUIET;
+        return 0;
+    }
+
+    int cells = count * device_count;
+    console->lines = cells + 2;
+    console->frame_cap = (size_t)console->lines * (DASHBOARD_WIDTH + 16) + 64;
+    console->screen = calloc(console->lines, sizeof(console->screen[0]));
+    console->frame = malloc(console->frame_cap);
+    console->rtt_us = calloc(cells ? cells : 1, sizeof(console->rtt_us[0]));
+    console->status = malloc(cells ? cells : 1);
+    if (console->screen == NULL || console->frame == NULL || console->rtt_us == NULL || console->status == NULL) {
+        perror("Error allocating memory for dashboard");
+        dashboard_close(console);
+        return -1;
+    }
+    memset(console->status, ' ', cells ? cells : 1);
+
+    // Start from an empty screen; every line is drawn on the first update
+    fputs("\033[H\033[2J", stdout);
+    fflush(stdout);
+    for (int l = 0; l < console->lines; l++) {
+        console->screen[l][0] = '\0';
+    }
+    return 0;
+}
+
+// Function to get the first information line of a response for display
+// The echoed command, blank lines and the final OK are skipped.
+size_t response_summary(const char *data, size_t len, const char **text) {
+    const char *end = data + len;
+
+    while (data < end) {
+        const char *nl = memchr(data, '\n', end - data);
+        const char *next = nl ? nl + 1 : end;
+        size_t text_len = strcspn(data, "\r\n");
+        if (text_len > (size_t)(next - data)) {
+            text_len = next - data;
+        }
+        if (text_len > 0 && strncasecmp(data, "AT", 2) != 0 &&
+            !(text_len == 2 && strncmp(data, "OK", 2) == 0)) {
+            *text = data;
+            return text_len;
+        }
+        data = next;
+    }
+    *text = "";
+    return 0;
+}
+
+// Function to redraw the lines of the dashboard that changed
+// Called when the cycle of device `updated` finishes; there is one line per
+// command of every device, prefixed with the device label if there are several.
+void dashboard_update(struct console *console, const struct modem_device *devices, char *commands[], int count, int updated) {
+    const struct cycle_state *cycle = &devices[updated].cycle;
+    console->cycles++;
     for (int i = 0; i < count; i++) {
-        fprintf(file, ",\"%s\"", commands[i]);
+        if (cycle->due[i]) {
+            const struct response_info *info = &cycle->infos[i];
+            console->rtt_us[updated * count + i] = info->rtt_us;
+            console->status[updated * count + i] = !info->complete ? 'T' : info->error ? 'E' : 'O';
+        }
+    }
+
+    long long now = monotonic_ms();
+    if (now < console->next_refresh_ms) {
+        return; // Shown on a later cycle
+    }
+    console->next_refresh_ms = now + console->refresh_ms;
+
+    size_t used = 0;
+    for (int l = 0; l < console->lines; l++) {
+        char line[DASHBOARD_WIDTH + 1];
+
+        if (l == 0) {
+            snprintf(line, sizeof(line), "%s  cycle %lu", cycle->timestamp, console->cycles);
+        } else if (l == 1) {
+            snprintf(line, sizeof(line), "%s%-24s %-9s %-6s %s", console->device_count > 1 ? "Device     " : "",
+                     "Command", "RTT", "Status", "Response");
+        } else {
+            int cell = l - 2;
+            int i = cell % count;
+            const struct cycle_state *shown = &devices[cell / count].cycle;
+            char label[16] = "";
+            if (console->device_count > 1) {
+                snprintf(label, sizeof(label), "%-10.10s ", devices[cell / count].label);
+            }
+            const char *status = console->status[cell] == 'O' ? "ok" : console->status[cell] == 'E' ? "error" :
+                                 console->status[cell] == 'T' ? "timeout" : "-";
+            const char *text;
+            size_t text_len = response_summary(shown->responses[i].data, shown->responses[i].len, &text);
+            snprintf(line, sizeof(line), "%s%-24.24s %6.1f ms %-6s %.*s", label, commands[i],
+                     console->rtt_us[cell] / 1000.0, status, (int)text_len, text);
+        }
+
+        if (strcmp(line, console->screen[l]) == 0) {
+            continue; // Unchanged on screen
+        }
+        strcpy(console->screen[l], line);
+
+        // Move to the line, rewrite it and clear what is left of the old text
+        int n = snprintf(console->frame + used, console->frame_cap - used, "\033[%d;1H%s\033[K", l + 1, line);
+        if (n > 0 && (size_t)n < console->frame_cap - used) {
+            used += n;
+        }
+        console->lines_written++;
+    }
+
+    if (used > 0) {
+        const char *p = console->frame;
+        while (used > 0) {
+            ssize_t n = write(STDOUT_FILENO, p, used);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            p += n;
+            used -= n;
+        }
+        console->redraws++;
     }
-    fprintf(file, "\n");
-    return file;
 }
 
-// Signal handler for graceful termination
+// Function to leave the dashboard and move the cursor below it
+void dashboard_close(struct console *console) {
+    if (console->mode == CONSOLE_DASHBOARD && console->screen != NULL) {
+        printf("\033[%d;1H\n", console->lines);
+        printf("Dashboard: %lu redraws, %lu lines written\n", console->redraws, console->lines_written);
+    }
+    free(console->screen);
+    free(console->frame);
+    free(console->rtt_us);
+    free(console->status);
+    console->screen = NULL;
+    console->frame = NULL;
+    console->rtt_us = NULL;
+    console->status = NULL;
+}
+
+// Function to start a helper thread with SIGINT, SIGTERM and SIGUSR1 blocked
+// The signals then always interrupt the polling loop, never a helper.
+int start_thread(pthread_t *thread, void *(*main)(void *), void *arg) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGUSR1);
+
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int err = pthread_create(thread, NULL, main, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return err;
+}
+
+// Signal handler for graceful termination and the SIGUSR1 dump
 void signal_handler(int signum) {
+    if (signum == SIGUSR1) {
+        dump_requested = 1;
+        return;
+    }
     running = 0;
 }
@@ -0,0 +1,317 @@
+/**  RM500Q Modem Monitor - binary decoder
+ *
+ *   Converts a data file written with `output_format: binary` back into CSV: one row per cycle, a
+ * Timestamp column (the start of the cycle, as in the monitor's CSV output) and one column per command
+ * holding the full response text (binary files are lossless, so the typed columns of the CSV output are
+ * not applied). Unsolicited result codes go in the URC column as "<time> <text>" lines, stray lines as
+ * "<time> [stray] <text>". With -i the offset index stored at the end of the file is listed instead.
+ *
+ *   Usage: modem_decode [-i] input.bin [output.csv]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "modem_record.h"
+
+// Contents of a binary data file being decoded
+struct decoder {
+    FILE *file;
+    uint32_t command_count;
+    char **commands;      // Command dictionary
+    uint64_t records_end; // Offset where the records stop (index or end of file)
+    uint64_t index_count;
+};
+
+// Function prototypes
+int open_binary_file(struct decoder *dec, const char *filename);
+void close_binary_file(struct decoder *dec);
+int decode_to_csv(struct decoder *dec, FILE *csv);
+int list_index(struct decoder *dec);
+void write_timestamp(FILE *csv, uint64_t timestamp_ns);
+int format_timestamp(char *buf, size_t size, uint64_t timestamp_ns);
+void write_quoted(FILE *csv, const char *text, size_t len);
+
+// Main function
+int main(int argc, char *argv[]) {
+    int index_mode = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i")) != -1) {
+        if (opt == 'i') {
+            index_mode = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-i] input.bin [output.csv]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-i] input.bin [output.csv]\n", argv[0]);
+        return 1;
+    }
+
+    struct decoder dec;
+    if (open_binary_file(&dec, argv[optind]) != 0) {
+        return 1;
+    }
+
+    int result;
+    if (index_mode) {
+        result = list_index(&dec);
+    } else {
+        FILE *csv = stdout;
+        if (optind + 1 < argc) {
+            csv = fopen(argv[optind + 1], "w");
+            if (csv == NULL) {
+                perror("Error creating CSV file");
+                close_binary_file(&dec);
+                return 1;
+            }
+        }
+        result = decode_to_csv(&dec, csv);
+        if (csv != stdout) {
+            fclose(csv);
+        }
+    }
+
+    close_binary_file(&dec);
+    return result == 0 ? 0 : 1;
+}
+
+// Function to open a binary data file and read its header and dictionary
+int open_binary_file(struct decoder *dec, const char *filename) {
+    memset(dec, 0, sizeof(*dec));
+
+    dec->file = fopen(filename, "rb");
+    if (dec->file == NULL) {
+        perror("Error opening binary file");
+        return -1;
+    }
+
+    struct modem_bin_header header;
+    if (fread(&header, sizeof(header), 1, dec->file) != 1 ||
+        memcmp(header.magic, MODEM_BIN_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "'%s' is not a modem monitor binary file\n", filename);
+        fclose(dec->file);
+        return -1;
+    }
+    if (header.version != MODEM_BIN_VERSION) {
+        fprintf(stderr, "Unsupported binary file version %u\n", header.version);
+        fclose(dec->file);
+        return -1;
+    }
+
+    dec->command_count = header.command_count;
+    dec->commands = calloc(header.command_count, sizeof(char *));
+    if (header.command_count > 0 && dec->commands == NULL) {
+        perror("Error allocating memory for command dictionary");
+        fclose(dec->file);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < header.command_count; i++) {
+        uint16_t len;
+        if (fread(&len, sizeof(len), 1, dec->file) != 1 ||
+            (dec->commands[i] = calloc(len + 1, 1)) == NULL ||
+            fread(dec->commands[i], 1, len, dec->file) != len) {
+            fprintf(stderr, "Truncated command dictionary\n");
+            close_binary_file(dec);
+            return -1;
+        }
+    }
+
+    // A cleanly closed file ends with a footer locating the index
+    long records_start = ftell(dec->file);
+    struct modem_bin_footer footer;
+    fseek(dec->file, 0, SEEK_END);
+    long size = ftell(dec->file);
+    dec->records_end = size;
+    if (size >= records_start + (long)sizeof(footer)) {
+        fseek(dec->file, size - sizeof(footer), SEEK_SET);
+        if (fread(&footer, sizeof(footer), 1, dec->file) == 1 &&
+            memcmp(footer.magic, MODEM_BIN_FOOTER_MAGIC, sizeof(footer.magic)) == 0) {
+            dec->records_end = footer.index_offset;
+            dec->index_count = footer.index_count;
+        }
+    }
+    fseek(dec->file, records_start, SEEK_SET);
+    return 0;
+}
+
+// Function to release a decoder
+void close_binary_file(struct decoder *dec) {
+    for (uint32_t i = 0; i < dec->command_count && dec->commands; i++) {
+        free(dec->commands[i]);
+    }
+    free(dec->commands);
+    if (dec->file != NULL) {
+        fclose(dec->file);
+    }
+    dec->file = NULL;
+    dec->commands = NULL;
+}
+
+// Function to convert every record into CSV rows, one row per cycle
+int decode_to_csv(struct decoder *dec, FILE *csv) {
+    char **cells = calloc(dec->command_count + 1, sizeof(char *));
+    uint32_t *lengths = calloc(dec->command_count + 1, sizeof(uint32_t));
+    if (cells == NULL || lengths == NULL) {
+        perror("Error allocating memory for row");
+        free(cells);
+        free(lengths);
+        return -1;
+    }
+
+    // Header row, as written by the monitor
+    fprintf(csv, "Timestamp");
+    for (uint32_t i = 0; i < dec->command_count; i++) {
+        fprintf(csv, ",");
+        write_quoted(csv, dec->commands[i], strlen(dec->commands[i]));
+    }
+    fprintf(csv, "\n");
+
+    int have_row = 0;
+    uint32_t row_cycle = 0;
+    uint64_t row_timestamp = 0;
+    int result = 0;
+
+    while (1) {
+        struct modem_bin_record record;
+        long offset = ftell(dec->file);
+        int at_end = (uint64_t)offset + sizeof(record) > dec->records_end ||
+                     fread(&record, sizeof(record), 1, dec->file) != 1;
+        char *payload = NULL;
+
+        if (!at_end) {
+            payload = malloc(record.length + 1);
+            if (payload == NULL || (uint64_t)offset + sizeof(record) + record.length > dec->records_end ||
+                fread(payload, 1, record.length, dec->file) != record.length) {
+                fprintf(stderr, "Truncated record at offset %ld, stopping\n", offset);
+                free(payload);
+                at_end = 1;
+                payload = NULL;
+            }
+        }
+
+        // Flush the current row when the cycle changes
+        if (have_row && (at_end || record.cycle != row_cycle)) {
+            write_timestamp(csv, row_timestamp);
+            for (uint32_t i = 0; i < dec->command_count; i++) {
+                fprintf(csv, ",");
+                if (cells[i] != NULL) {
+                    write_quoted(csv, cells[i], lengths[i]);
+                    free(cells[i]);
+                    cells[i] = NULL;
+                }
+            }
+            fprintf(csv, "\n");
+            have_row = 0;
+        }
+
+        if (at_end) {
+            break;
+        }
+
+        if (record.command_id >= dec->command_count) {
+            fprintf(stderr, "Record at offset %ld refers to unknown command %u\n", offset, record.command_id);
+            free(payload);
+            result = -1;
+            continue;
+        }
+
+        if (!have_row) {
+            have_row = 1;
+            row_cycle = record.cycle;
+            row_timestamp = record.timestamp_ns;
+        }
+        if (!(record.flags & MODEM_BIN_FLAG_URC)) {
+            free(cells[record.command_id]);
+            cells[record.command_id] = payload;
+            lengths[record.command_id] = record.length;
+            continue;
+        }
+
+        // URCs of one cycle share a cell, one "<time> <text>" line each
+        char stamp[48];
+        int stamp_len = format_timestamp(stamp, sizeof(stamp), record.received_ns);
+        if (record.flags & MODEM_BIN_FLAG_STRAY) {
+            stamp_len += snprintf(stamp + stamp_len, sizeof(stamp) - stamp_len, " [stray]");
+        }
+        uint32_t used = cells[record.command_id] ? lengths[record.command_id] + 1 : 0;
+        char *cell = realloc(cells[record.command_id], used + stamp_len + 1 + record.length + 1);
+        if (cell == NULL) {
+            perror("Error allocating memory for row");
+            free(payload);
+            result = -1;
+            continue;
+        }
+        if (used > 0) {
+            cell[used - 1] = '\n';
+        }
+        memcpy(cell + used, stamp, stamp_len);
+        cell[used + stamp_len] = ' ';
+        memcpy(cell + used + stamp_len + 1, payload, record.length);
+        cells[record.command_id] = cell;
+        lengths[record.command_id] = used + stamp_len + 1 + record.length;
+        free(payload);
+    }
+
+    free(cells);
+    free(lengths);
+    return result;
+}
+
+// Function to print the offset index of a cleanly closed file
+int list_index(struct decoder *dec) {
+    if (dec->index_count == 0) {
+        fprintf(stderr, "File has no index (not closed cleanly?)\n");
+        return -1;
+    }
+
+    fseek(dec->file, dec->records_end, SEEK_SET);
+    printf("Timestamp,Offset\n");
+    for (uint64_t i = 0; i < dec->index_count; i++) {
+        struct modem_bin_index_entry entry;
+        if (fread(&entry, sizeof(entry), 1, dec->file) != 1) {
+            fprintf(stderr, "Truncated index\n");
+            return -1;
+        }
+        write_timestamp(stdout, entry.timestamp_ns);
+        printf(",%llu\n", (unsigned long long)entry.offset);
+    }
+    return 0;
+}
+
+// Function to write a timestamp the way the monitor formats it
+void write_timestamp(FILE *csv, uint64_t timestamp_ns) {
+    char stamp[48];
+    format_timestamp(stamp, sizeof(stamp), timestamp_ns);
+    fprintf(csv, "\"%s\"", stamp);
+}
+
+// Function to format a timestamp as local time with nanoseconds, returns its length
+int format_timestamp(char *buf, size_t size, uint64_t timestamp_ns) {
+    time_t seconds = timestamp_ns / 1000000000ULL;
+    struct tm t;
+    localtime_r(&seconds, &t);
+    return snprintf(buf, size, "%04d-%02d-%02d %02d:%02d:%02d.%09u",
+                    t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+                    t.tm_hour, t.tm_min, t.tm_sec, (unsigned)(timestamp_ns % 1000000000ULL));
+}
+
+// Function to write a quoted CSV cell, doubling embedded quotes
+void write_quoted(FILE *csv, const char *text, size_t len) {
+    fputc('"', csv);
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '"') {
+            fputc('"', csv);
+        }
+        fputc(text[i], csv);
+    }
+    fputc('"', csv);
+}
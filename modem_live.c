@@ -0,0 +1,98 @@
+/**  RM500Q Modem Monitor - live values
+ *
+ *   Prints the latest parsed values the monitor publishes in shared memory (`shared_memory:` setting),
+ * one block per device. Uses the reader functions of modem_shm.h, so it is also an example of reading
+ * the live samples from another program.
+ *
+ *   Usage: modem_live [-w interval_ms] [name]
+ *
+ *   The name defaults to /modem_monitor. With -w the values are printed again every interval until
+ * interrupted or the monitor stops.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "modem_shm.h"
+
+#define DEFAULT_SHM_NAME "/modem_monitor"
+
+// Function prototypes
+void print_device(const struct modem_shm_reader *reader, int device, int32_t values[]);
+
+// Main function
+int main(int argc, char *argv[]) {
+    int interval_ms = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:")) != -1) {
+        if (opt == 'w' && atoi(optarg) > 0) {
+            interval_ms = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-w interval_ms] [name]\n", argv[0]);
+            return 1;
+        }
+    }
+    const char *name = optind < argc ? argv[optind] : DEFAULT_SHM_NAME;
+
+    struct modem_shm_reader reader;
+    if (modem_shm_open(&reader, name) != 0) {
+        fprintf(stderr, "No live samples at '%s' (is the monitor running with shared_memory: %s?)\n", name, name);
+        return 1;
+    }
+
+    int32_t *values = malloc((reader.header->field_count ? reader.header->field_count : 1) * sizeof(int32_t));
+    if (values == NULL) {
+        perror("Error allocating memory for values");
+        modem_shm_close(&reader);
+        return 1;
+    }
+
+    do {
+        for (uint32_t d = 0; d < reader.header->device_count; d++) {
+            print_device(&reader, d, values);
+        }
+        if (!atomic_load(&reader.header->running)) {
+            fprintf(stderr, "Monitor stopped\n");
+            break;
+        }
+        if (interval_ms > 0) {
+            printf("\n");
+            fflush(stdout);
+            usleep(interval_ms * 1000);
+        }
+    } while (interval_ms > 0);
+
+    free(values);
+    modem_shm_close(&reader);
+    return 0;
+}
+
+// Function to print the latest sample of a device
+void print_device(const struct modem_shm_reader *reader, int device, int32_t values[]) {
+    struct modem_shm_sample sample;
+    printf("%s:", reader->devices[device].label);
+    if (modem_shm_latest(reader, device, &sample, values) != 0) {
+        printf(" no sample yet\n");
+        return;
+    }
+
+    time_t seconds = sample.timestamp_ns / 1000000000LL;
+    struct tm t;
+    localtime_r(&seconds, &t);
+    printf(" sample %llu at %02d:%02d:%02d.%03d\n", (unsigned long long)sample.sample,
+           t.tm_hour, t.tm_min, t.tm_sec, (int)(sample.timestamp_ns / 1000000 % 1000));
+
+    for (uint32_t f = 0; f < reader->header->field_count; f++) {
+        if (values[f] == MODEM_SHM_MISSING) {
+            printf("  %-40s -\n", reader->fields[f].name);
+        } else {
+            printf("  %-40s %d\n", reader->fields[f].name, values[f]);
+        }
+    }
+}
@@ -0,0 +1,297 @@
+/**  RM500Q Modem Monitor - time range query
+ *
+ *   Prints the rows of a CSV data file that fall in a time range. The sidecar index written next to the
+ * data file (<file>.csv.idx) is searched for the last indexed row before the start of the range, so only
+ * the rows from there on are read. Rotated segments compressed to .csv.gz are read through zlib from the
+ * start: a gzip stream cannot be entered in the middle, so their index would save no reading.
+ *
+ *   Usage: modem_query data.csv[.gz] FROM [TO]
+ *
+ *   FROM and TO are local times such as "2026-10-12 14:00" or "2026-10-12 14:00:30.5". FROM is inclusive
+ * and TO exclusive; without TO every row from FROM on is printed.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "modem_record.h"
+
+#define READ_BUFFER_SIZE 65536
+
+// CSV data file being read record by record
+struct csv_reader {
+    gzFile file;
+    char buf[READ_BUFFER_SIZE];
+    size_t len;           // Bytes in buf
+    size_t pos;           // Next byte to look at
+    char *record;         // Current record, quotes and embedded newlines included
+    size_t record_len;
+    size_t record_cap;
+};
+
+// Function prototypes
+int parse_query_time(const char *text, long long *timestamp_ns);
+int format_query_time(long long timestamp_ns, char *buf, size_t size);
+long long find_start_offset(const char *data_filename, long long from_ns);
+int reader_next(struct csv_reader *reader);
+int record_timestamp(const char *record, size_t len, const char **text, size_t *text_len);
+int compare_timestamp(const char *text, size_t len, const char *bound);
+
+// Main function
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: %s data.csv[.gz] FROM [TO]\n", argv[0]);
+        return 1;
+    }
+
+    const char *from = argv[2];
+    const char *to = argc == 4 ? argv[3] : NULL;
+    long long from_ns, to_ns;
+    if (parse_query_time(from, &from_ns) != 0 || (to != NULL && parse_query_time(to, &to_ns) != 0)) {
+        fprintf(stderr, "Times must look like \"YYYY-MM-DD HH:MM[:SS[.fraction]]\"\n");
+        return 1;
+    }
+
+    // Rows are compared in the zero-padded form they are written in, so "2026-1-5 9:00" works too
+    char from_text[64], to_text[64];
+    if (format_query_time(from_ns, from_text, sizeof(from_text)) != 0 ||
+        (to != NULL && format_query_time(to_ns, to_text, sizeof(to_text)) != 0)) {
+        fprintf(stderr, "Times must look like \"YYYY-MM-DD HH:MM[:SS[.fraction]]\"\n");
+        return 1;
+    }
+
+    struct csv_reader reader = { 0 };
+    reader.file = gzopen(argv[1], "rb"); // Also reads uncompressed files
+    if (reader.file == NULL) {
+        perror("Error opening data file");
+        return 1;
+    }
+    gzbuffer(reader.file, READ_BUFFER_SIZE);
+
+    // The header row always comes first
+    if (reader_next(&reader) <= 0) {
+        fprintf(stderr, "'%s' is empty\n", argv[1]);
+        gzclose(reader.file);
+        return 1;
+    }
+    fwrite(reader.record, 1, reader.record_len, stdout);
+
+    // Skip to the last indexed row before the range (uncompressed files only)
+    long long offset = gzdirect(reader.file) ? find_start_offset(argv[1], from_ns) : 0;
+    if (offset > (long long)reader.record_len) {
+        if (gzseek(reader.file, offset, SEEK_SET) < 0) {
+            fprintf(stderr, "Index points past the end of the data file, reading from the start\n");
+            gzrewind(reader.file);
+            reader_next(&reader); // Header again
+        }
+        reader.len = reader.pos = 0;
+    }
+
+    // Stream the rows of the range
+    unsigned long scanned = 0, matched = 0;
+    while (reader_next(&reader) > 0) {
+        const char *stamp;
+        size_t stamp_len;
+        scanned++;
+        if (record_timestamp(reader.record, reader.record_len, &stamp, &stamp_len) != 0) {
+            continue; // Truncated or foreign row
+        }
+        if (compare_timestamp(stamp, stamp_len, from_text) < 0) {
+            continue;
+        }
+        if (to != NULL && compare_timestamp(stamp, stamp_len, to_text) >= 0) {
+            break;
+        }
+        fwrite(reader.record, 1, reader.record_len, stdout);
+        matched++;
+    }
+
+    fprintf(stderr, "%lu rows read, %lu in range\n", scanned, matched);
+    free(reader.record);
+    gzclose(reader.file);
+    return 0;
+}
+
+// Function to convert a query time (local time) to nanoseconds since the epoch
+int parse_query_time(const char *text, long long *timestamp_ns) {
+    struct tm t = { 0 };
+    int seconds = 0, used = 0;
+    long long fraction_ns = 0;
+
+    int fields = sscanf(text, "%d-%d-%d %d:%d:%d%n", &t.tm_year, &t.tm_mon, &t.tm_mday,
+                        &t.tm_hour, &t.tm_min, &seconds, &used);
+    if (fields < 5) {
+        return -1;
+    }
+
+    // Digits after the seconds, beyond nanoseconds ignored
+    if (fields == 6 && text[used] == '.') {
+        long long scale = 100000000LL;
+        for (const char *p = text + used + 1; *p >= '0' && *p <= '9'; p++) {
+            fraction_ns += (*p - '0') * scale;
+            scale /= 10;
+        }
+    }
+    t.tm_year -= 1900;
+    t.tm_mon -= 1;
+    t.tm_sec = seconds;
+    t.tm_isdst = -1; // Let mktime() work out daylight saving time
+
+    time_t epoch = mktime(&t);
+    if (epoch == (time_t)-1) {
+        return -1;
+    }
+    *timestamp_ns = (long long)epoch * 1000000000LL + fraction_ns;
+    return 0;
+}
+
+// Function to write a query time the way rows are stamped: "YYYY-MM-DD HH:MM:SS.nnnnnnnnn"
+int format_query_time(long long timestamp_ns, char *buf, size_t size) {
+    time_t second = timestamp_ns / 1000000000LL;
+    struct tm t;
+    if (localtime_r(&second, &t) == NULL) {
+        return -1;
+    }
+    size_t len = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &t);
+    if (len == 0) {
+        return -1;
+    }
+    snprintf(buf + len, size - len, ".%09lld", timestamp_ns % 1000000000LL);
+    return 0;
+}
+
+// Function to find where to start reading with the sidecar index
+// Binary-searches the index for the last row stamped before from_ns.
+// Returns its offset, or 0 to read from the start.
+long long find_start_offset(const char *data_filename, long long from_ns) {
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s.idx", data_filename);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "No index '%s', reading from the start\n", filename);
+        return 0;
+    }
+
+    struct modem_csv_index_header header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, MODEM_CSV_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MODEM_CSV_INDEX_VERSION) {
+        fprintf(stderr, "'%s' is not a CSV index, reading from the start\n", filename);
+        close(fd);
+        return 0;
+    }
+
+    off_t size = lseek(fd, 0, SEEK_END);
+    long long count = (size - (off_t)sizeof(header)) / (off_t)sizeof(struct modem_bin_index_entry);
+    long long lo = 0, hi = count - 1, found = -1;
+    uint64_t offset = 0;
+
+    // Entries are in row order, and rows in time order
+    while (lo <= hi) {
+        long long mid = lo + (hi - lo) / 2;
+        struct modem_bin_index_entry entry;
+        if (pread(fd, &entry, sizeof(entry), sizeof(header) + mid * sizeof(entry)) != sizeof(entry)) {
+            break;
+        }
+        if ((long long)entry.timestamp_ns < from_ns) {
+            found = mid;
+            offset = entry.offset;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    close(fd);
+    return found >= 0 ? (long long)offset : 0;
+}
+
+// Function to read the next CSV record
+// Newlines inside quoted cells (multi-line responses) do not end the record.
+// Returns 1 with the record in reader->record, 0 at the end of the file and -1 on error.
+int reader_next(struct csv_reader *reader) {
+    int quoted = 0;
+    reader->record_len = 0;
+
+    while (1) {
+        if (reader->pos == reader->len) {
+            int n = gzread(reader->file, reader->buf, sizeof(reader->buf));
+            if (n < 0) {
+                fprintf(stderr, "Error reading data file\n");
+                return -1;
+            }
+            if (n == 0) {
+                return reader->record_len > 0; // Last record without a newline
+            }
+            reader->len = n;
+            reader->pos = 0;
+        }
+
+        // Copy up to the end of the record or of the buffer
+        size_t start = reader->pos;
+        int done = 0;
+        while (reader->pos < reader->len) {
+            char c = reader->buf[reader->pos++];
+            if (c == '"') {
+                quoted = !quoted;
+            } else if (c == '\n' && !quoted) {
+                done = 1;
+                break;
+            }
+        }
+
+        size_t chunk = reader->pos - start;
+        if (reader->record_len + chunk > reader->record_cap) {
+            size_t cap = reader->record_cap ? reader->record_cap : 4096;
+            while (cap < reader->record_len + chunk) {
+                cap *= 2;
+            }
+            char *grown = realloc(reader->record, cap);
+            if (grown == NULL) {
+                perror("Error allocating memory for row");
+                return -1;
+            }
+            reader->record = grown;
+            reader->record_cap = cap;
+        }
+        memcpy(reader->record + reader->record_len, reader->buf + start, chunk);
+        reader->record_len += chunk;
+
+        if (done) {
+            return 1;
+        }
+    }
+}
+
+// Function to find the timestamp cell at the start of a row: "YYYY-MM-DD HH:MM:SS.nnnnnnnnn"
+int record_timestamp(const char *record, size_t len, const char **text, size_t *text_len) {
+    if (len < 2 || record[0] != '"') {
+        return -1;
+    }
+    const char *end = memchr(record + 1, '"', len - 1);
+    if (end == NULL) {
+        return -1;
+    }
+    *text = record + 1;
+    *text_len = end - (record + 1);
+    return 0;
+}
+
+// Function to compare a row timestamp with a query time
+// Both are fixed-width local times, so they order like strings.
+int compare_timestamp(const char *text, size_t len, const char *bound) {
+    size_t bound_len = strlen(bound);
+    int result = strncmp(text, bound, len < bound_len ? len : bound_len);
+    if (result != 0) {
+        return result;
+    }
+    return len < bound_len ? -1 : len > bound_len ? 1 : 0;
+}
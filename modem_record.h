@@ -0,0 +1,96 @@
+/**  RM500Q Modem Monitor - binary record format
+ *
+ *   Layout of the files written with `output_format: binary`, shared by the monitor, modem_decode and
+ * modem_query.
+ * Integers are stored in host byte order (little-endian on the supported targets).
+ *
+ *     file       := header dictionary record* [index footer]
+ *     header     := struct modem_bin_header
+ *     dictionary := command_count x (uint16 length, command bytes)
+ *     record     := struct modem_bin_record, payload bytes
+ *     index      := index_count x struct modem_bin_index_entry
+ *     footer     := struct modem_bin_footer
+ *
+ *   Records are appended as they are sampled. The index, which maps the timestamp of every Nth cycle to
+ * the offset of its first record, is only written when the file is closed; a file without a footer
+ * (e.g. after a power loss) is still readable up to its last complete record. N is not fixed: it doubles
+ * whenever a long file would need more than a few thousand entries, so readers must not assume a stride.
+ *
+ *   CSV data files get a sidecar index, <file>.csv.idx: a struct modem_csv_index_header followed by
+ * struct modem_bin_index_entry entries for every Nth row, appended once the row has been written to the CSV
+ * file. Offsets refer to the uncompressed CSV file; once a segment is compressed to .csv.gz, modem_query
+ * scans it from the start.
+ *
+ *   Commands configured with `on_change` only get a record when their response changes. Every keyframe
+ * interval (and at the start of every file) their latest response is repeated with
+ * MODEM_BIN_FLAG_REPEAT, so decoding can start at any keyframe.
+ *
+ *   With `urc: on` the dictionary ends with a "URC" entry. Unsolicited result codes are stored as records
+ * for it with MODEM_BIN_FLAG_URC and their arrival time in received_ns; a cycle can have several of them. Lines received outside a response that are no URCs (a response that came after
+ * its deadline, noise) are stored the same way with MODEM_BIN_FLAG_STRAY added.
+ *
+ */
+
+#ifndef MODEM_RECORD_H
+#define MODEM_RECORD_H
+
+#include <stdint.h>
+
+#define MODEM_BIN_MAGIC "RM5QBIN1"
+#define MODEM_BIN_FOOTER_MAGIC "RM5QIDX1"
+#define MODEM_CSV_INDEX_MAGIC "RM5QCIX1"
+#define MODEM_CSV_INDEX_VERSION 1
+#define MODEM_BIN_VERSION 1
+
+// Record flags
+#define MODEM_BIN_FLAG_ERROR 0x0001  // The command failed or timed out
+#define MODEM_BIN_FLAG_REPEAT 0x0002 // Keyframe copy of an unchanged on-change response, not a new sample
+#define MODEM_BIN_FLAG_URC 0x0004    // Unsolicited result code; command_id is the "URC" dictionary entry
+#define MODEM_BIN_FLAG_STRAY 0x0008  // With MODEM_BIN_FLAG_URC: a line outside a response that is no URC
+
+// File header
+struct modem_bin_header {
+    char magic[8];          // MODEM_BIN_MAGIC
+    uint32_t version;       // MODEM_BIN_VERSION
+    uint32_t command_count; // Entries in the command dictionary that follows
+};
+
+// Header of one sampled response; the payload is the response text
+// Times are CLOCK_REALTIME in nanoseconds since the epoch.
+struct modem_bin_record {
+    uint64_t timestamp_ns;  // Start of the cycle, the row timestamp of CSV files
+    uint64_t sent_ns;       // When the command was sent, 0 for keyframe copies and URCs
+    uint64_t received_ns;   // When its final result code (or the URC) arrived, 0 if unknown
+    uint32_t cycle;         // Cycle number, shared by the records of one row
+    uint32_t length;        // Payload length in bytes
+    uint16_t command_id;    // Index into the command dictionary
+    uint16_t flags;         // MODEM_BIN_FLAG_*
+    uint32_t reserved;
+};
+
+// Index entry pointing at the first record of a cycle
+struct modem_bin_index_entry {
+    uint64_t timestamp_ns;
+    uint64_t offset;
+};
+
+// Last bytes of a cleanly closed file
+struct modem_bin_footer {
+    char magic[8];          // MODEM_BIN_FOOTER_MAGIC
+    uint64_t index_offset;  // Offset of the first index entry, also the end of the records
+    uint64_t index_count;
+};
+
+// Header of the sidecar index of a CSV data file
+struct modem_csv_index_header {
+    char magic[8];          // MODEM_CSV_INDEX_MAGIC
+    uint32_t version;       // MODEM_CSV_INDEX_VERSION
+    uint32_t stride;        // Rows between index entries
+};
+
+_Static_assert(sizeof(struct modem_csv_index_header) == 16, "unexpected index header padding");
+_Static_assert(sizeof(struct modem_bin_header) == 16, "unexpected header padding");
+_Static_assert(sizeof(struct modem_bin_record) == 40, "unexpected record padding");
+_Static_assert(sizeof(struct modem_bin_footer) == 24, "unexpected footer padding");
+
+#endif
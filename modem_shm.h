@@ -0,0 +1,215 @@
+/**  RM500Q Modem Monitor - live samples in shared memory
+ *
+ *   With `shared_memory: <name>` the monitor publishes the parsed values of every cycle (the typed
+ * columns of the CSV output, e.g. "AT+CSQ rssi" or "AT+QENG="servingcell" lte_sinr") in a POSIX
+ * shared-memory object, so local dashboards and agents can read the current values without parsing the
+ * data file and without any system call once the object is mapped.
+ *
+ *     object  := header field* device* slot*
+ *     header  := struct modem_shm_header
+ *     field   := struct modem_shm_field, one per value of a sample
+ *     device  := struct modem_shm_device, one per polled modem
+ *     slot    := struct modem_shm_slot, then field_count int32 values, padded to slot_size
+ *
+ *   Every device has a ring of slot_count slots. Sample n of a device is in slot n % slot_count of its
+ * ring, and the device's `head` is the number of samples published. A sample holds the latest value of
+ * every field: values of commands that were not due on that cycle are carried over, values that could
+ * not be read are MODEM_SHM_MISSING.
+ *
+ *   Each slot is guarded by a sequence lock. The writer makes `sequence` odd, writes the slot and makes
+ * it even again; a reader copies the slot between two reads of an even, unchanged sequence, and tries
+ * again otherwise. Readers never block the monitor.
+ *
+ *   The functions below are the reader side. Link with -lrt on systems where shm_open() is not in libc.
+ *
+ *     struct modem_shm_reader reader;
+ *     if (modem_shm_open(&reader, "/modem_monitor") == 0) {
+ *         int sinr = modem_shm_field_index(&reader, "AT+QENG=\"servingcell\" lte_sinr");
+ *         int32_t values[reader.header->field_count];
+ *         struct modem_shm_sample sample;
+ *         if (sinr >= 0 && modem_shm_latest(&reader, 0, &sample, values) == 0)
+ *             printf("SINR %d\n", values[sinr]);
+ *         modem_shm_close(&reader);
+ *     }
+ *
+ */
+
+#ifndef MODEM_SHM_H
+#define MODEM_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MODEM_SHM_MAGIC "RM5QSHM1"
+#define MODEM_SHM_VERSION 1
+#define MODEM_SHM_MISSING INT32_MIN // Value not present in the response, or not sampled yet
+#define MODEM_SHM_NAME_LEN 64
+#define MODEM_SHM_READ_RETRIES 1000 // Attempts before a reader gives up on a slot being rewritten
+
+// Start of the shared-memory object
+struct modem_shm_header {
+    char magic[8];              // MODEM_SHM_MAGIC, written last when the object is ready
+    uint32_t version;           // MODEM_SHM_VERSION
+    uint32_t field_count;       // Values per sample
+    uint32_t device_count;
+    uint32_t slot_count;        // Slots per device, a power of two
+    uint32_t slot_size;         // Bytes per slot, values included
+    _Atomic uint32_t running;   // Cleared when the monitor exits
+    uint64_t fields_offset;     // Offsets from the start of the object
+    uint64_t devices_offset;
+    uint64_t slots_offset;      // Rings of all devices, one after the other
+    uint64_t size;              // Size of the whole object
+};
+
+// Name of one value, as in the CSV header
+struct modem_shm_field {
+    char name[MODEM_SHM_NAME_LEN];
+};
+
+// One polled modem
+struct modem_shm_device {
+    char label[MODEM_SHM_NAME_LEN]; // Name of its serial port
+    _Atomic uint64_t head;          // Samples published
+    uint64_t reserved[7];           // Keeps every head on its own cache line
+};
+
+// Header of one slot; field_count int32 values follow
+struct modem_shm_slot {
+    _Atomic uint32_t sequence;  // Odd while the slot is being written
+    uint32_t reserved;
+    uint64_t sample;            // Sample number, to tell a reused slot apart
+    int64_t timestamp_ns;       // Time of the cycle, CLOCK_REALTIME
+};
+
+// Sample copied out of a slot
+struct modem_shm_sample {
+    uint64_t sample;
+    int64_t timestamp_ns;
+};
+
+// Mapping of the object held by a reader
+struct modem_shm_reader {
+    const struct modem_shm_header *header;
+    const struct modem_shm_field *fields;
+    const struct modem_shm_device *devices;
+    const unsigned char *slots;
+    size_t size;
+};
+
+_Static_assert(sizeof(struct modem_shm_header) == 64, "unexpected header padding");
+_Static_assert(sizeof(struct modem_shm_device) == 128, "unexpected device padding");
+_Static_assert(sizeof(struct modem_shm_slot) == 24, "unexpected slot padding");
+
+// Function to map a live-sample object read-only, returns 0 or -1
+static inline int modem_shm_open(struct modem_shm_reader *reader, const char *name) {
+    memset(reader, 0, sizeof(*reader));
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct modem_shm_header)) {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    const struct modem_shm_header *header = base;
+    if (memcmp(header->magic, MODEM_SHM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MODEM_SHM_VERSION || header->size > (uint64_t)st.st_size) {
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    reader->header = header;
+    reader->fields = (const void *)((const unsigned char *)base + header->fields_offset);
+    reader->devices = (const void *)((const unsigned char *)base + header->devices_offset);
+    reader->slots = (const unsigned char *)base + header->slots_offset;
+    reader->size = st.st_size;
+    return 0;
+}
+
+// Function to unmap a live-sample object
+static inline void modem_shm_close(struct modem_shm_reader *reader) {
+    if (reader->header != NULL) {
+        munmap((void *)reader->header, reader->size);
+    }
+    memset(reader, 0, sizeof(*reader));
+}
+
+// Function to find a value by its CSV column name, -1 if it is not published
+static inline int modem_shm_field_index(const struct modem_shm_reader *reader, const char *name) {
+    for (uint32_t f = 0; f < reader->header->field_count; f++) {
+        if (strncmp(reader->fields[f].name, name, MODEM_SHM_NAME_LEN) == 0) {
+            return (int)f;
+        }
+    }
+    return -1;
+}
+
+// Function to find a device by its label, -1 if it is not polled
+static inline int modem_shm_device_index(const struct modem_shm_reader *reader, const char *label) {
+    for (uint32_t d = 0; d < reader->header->device_count; d++) {
+        if (strncmp(reader->devices[d].label, label, MODEM_SHM_NAME_LEN) == 0) {
+            return (int)d;
+        }
+    }
+    return -1;
+}
+
+// Function to get the number of samples a device has published
+static inline uint64_t modem_shm_head(const struct modem_shm_reader *reader, int device) {
+    return atomic_load_explicit(&reader->devices[device].head, memory_order_acquire);
+}
+
+// Function to copy sample n of a device into values[0..field_count)
+// Returns 0, or -1 if the sample is not published yet or was overwritten.
+static inline int modem_shm_read(const struct modem_shm_reader *reader, int device, uint64_t n,
+                                 struct modem_shm_sample *sample, int32_t values[]) {
+    const struct modem_shm_header *header = reader->header;
+    const struct modem_shm_slot *slot = (const void *)(reader->slots +
+        ((uint64_t)device * header->slot_count + (n & (header->slot_count - 1))) * header->slot_size);
+
+    for (int attempt = 0; attempt < MODEM_SHM_READ_RETRIES; attempt++) {
+        uint32_t before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue; // Being written
+        }
+        sample->sample = slot->sample;
+        sample->timestamp_ns = slot->timestamp_ns;
+        memcpy(values, slot + 1, header->field_count * sizeof(int32_t));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) == before) {
+            return sample->sample == n && before != 0 ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+// Function to copy the most recent sample of a device
+// Returns 0, or -1 if the device has not published anything yet.
+static inline int modem_shm_latest(const struct modem_shm_reader *reader, int device,
+                                   struct modem_shm_sample *sample, int32_t values[]) {
+    for (int attempt = 0; attempt < MODEM_SHM_READ_RETRIES; attempt++) {
+        uint64_t head = modem_shm_head(reader, device);
+        if (head == 0) {
+            return -1;
+        }
+        if (modem_shm_read(reader, device, head - 1, sample, values) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,622 @@
+/**  RM500Q Modem Simulator
+ *
+ *   Stand-in for a Quectel RM500Q-GL modem built on a pseudo terminal. The simulator answers AT
+ * commands with canned or scripted responses, so the monitor can be run and benchmarked without the
+ * hardware: point the `device:` setting of the monitor at the printed PTY path (or at the link made
+ * with -l). Response latency, jitter, fragmented writes and unsolicited result codes can be configured.
+ * With -n several independent modems are served by one process, one PTY each; their links are the -l
+ * path followed by the port number (link0, link1, ...).
+ *
+ *   Usage: modem_sim [-r script] [-c config] [-l link] [-n ports] [-d latency_ms] [-j jitter_ms]
+ *                    [-f fragment_bytes] [-g fragment_gap_us] [-u urc_interval_ms] [-U urc_line]
+ *
+ *   Script lines have the form `COMMAND [@latency_ms] => body`, where `\n` in the body separates lines.
+ * Repeating a command makes it cycle through its responses. OK is appended unless the body is an error.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <errno.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/resource.h>
+
+#define MAX_SCRIPT_ENTRIES 512
+#define MAX_URCS 16
+#define LINE_MAX_LEN 4096
+#define OUT_BUFFER_SIZE 65536
+#define MAX_PORTS 4096
+
+// A scripted or canned response
+struct sim_entry {
+    char *command;   // Command it answers, e.g. AT+CSQ
+    char *body;      // Response lines separated by "\r\n", without the final result code
+    int latency_ms;  // Extra latency for this command, -1 for the default
+};
+
+// State of the simulated serial port
+struct sim_port {
+    int master;
+    int slave;                 // Kept open so the master never sees a hangup
+    char slave_name[256];
+    char in[LINE_MAX_LEN];     // Command line being received
+    size_t in_len;
+    char out[OUT_BUFFER_SIZE]; // Bytes queued for the monitor
+    size_t out_len;
+    size_t out_pos;
+    long long next_write;      // When the next fragment may be written
+    char pending[OUT_BUFFER_SIZE]; // Response waiting for its latency to pass
+    size_t pending_len;
+    long long pending_due;     // When the pending response is released, 0 if none
+    int echo;
+    long long next_urc;
+    int urc_index;
+    unsigned int turns[MAX_SCRIPT_ENTRIES]; // Uses of repeated commands, by first entry
+};
+
+// Simulator options
+struct sim_options {
+    int latency_ms;
+    int jitter_ms;
+    int fragment_bytes;  // 0 writes whole responses
+    int fragment_gap_us;
+    int urc_interval_ms; // 0 disables URC injection
+    char *urcs[MAX_URCS];
+    int urc_count;
+};
+
+// Canned responses of an RM500Q-GL registered on LTE
+static const char *const canned[][2] = {
+    { "ATI", "Quectel\r\nRM500Q-GL\r\nRevision: RM500QGLABR11A06M4G" },
+    { "AT+CSQ", "+CSQ: 21,99" },
+    { "AT+CREG?", "+CREG: 0,1" },
+    { "AT+CGREG?", "+CGREG: 0,1" },
+    { "AT+CEREG?", "+CEREG: 0,1" },
+    { "AT+C5GREG?", "+C5GREG: 0,0" },
+    { "AT+COPS?", "+COPS: 0,0,\"Vivo\",7" },
+    { "AT+CGSN", "868371050000001" },
+    { "AT+CIMI", "724100000000001" },
+    { "AT+QNWINFO", "+QNWINFO: \"FDD LTE\",\"72410\",\"LTE BAND 3\",1650" },
+    { "AT+QCSQ", "+QCSQ: \"LTE\",-64,-96,124,-11" },
+    { "AT+QENG=\"servingcell\"", "+QENG: \"servingcell\",\"NOCONN\",\"LTE\",\"FDD\",724,10,8D6A0C,241,1650,3,5,5,1F5,-96,-11,-64,12,9,200,-" },
+    { "AT+QENG=\"neighbourcell\"", "+QENG: \"neighbourcell intra\",\"LTE\",1650,241,-11,-96,-64,14,37,2,10,6,62\r\n"
+                                   "+QENG: \"neighbourcell intra\",\"LTE\",1650,118,-14,-104,-70,8,29,2,10,6,62\r\n"
+                                   "+QENG: \"neighbourcell inter\",\"LTE\",3050,305,-13,-108,-77,4,0,-,-,-,-,-" },
+    { "AT+QTEMP", "+QTEMP: \"qfe_wtr_pa0\",\"33\"\r\n+QTEMP: \"modem-lte-sub6-pa1\",\"34\"\r\n+QTEMP: \"aoss0-usr\",\"35\"" },
+};
+
+static const char *const default_urcs[] = { "+CREG: 1", "+QIND: \"csq\",21,99", "+CEREG: 1" };
+
+// Global variable to handle termination
+volatile sig_atomic_t running = 1;
+
+static struct sim_entry entries[MAX_SCRIPT_ENTRIES];
+static int entry_count = 0;
+
+// Function prototypes
+long long monotonic_us(void);
+int add_entry(const char *command, const char *body, int latency_ms);
+int load_script(const char *filename);
+void check_config_coverage(const char *filename);
+struct sim_entry *find_entry(const char *command, unsigned int turns[]);
+int answer_command(struct sim_port *port, const char *line, char *out, size_t max_len, int *latency_ms);
+void handle_line(struct sim_port *port, const struct sim_options *opts, const char *line);
+void queue_output(struct sim_port *port, const char *data, size_t len);
+void service_port(struct sim_port *port, const struct sim_options *opts, long long now);
+void receive_input(struct sim_port *port, const struct sim_options *opts);
+int open_port(struct sim_port *port, const char *link);
+void signal_handler(int signum);
+
+// Main function
+int main(int argc, char *argv[]) {
+    struct sim_options opts = { .latency_ms = 20, .jitter_ms = 0, .fragment_bytes = 0,
+                                .fragment_gap_us = 0, .urc_interval_ms = 0, .urc_count = 0 };
+    const char *script = NULL;
+    const char *config = NULL;
+    const char *link = NULL;
+    int port_count = 1;
+    int numbered = 0; // Links get the port number appended
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:c:l:n:d:j:f:g:u:U:")) != -1) {
+        switch (opt) {
+        case 'r': script = optarg; break;
+        case 'c': config = optarg; break;
+        case 'l': link = optarg; break;
+        case 'n': port_count = atoi(optarg); numbered = 1; break;
+        case 'd': opts.latency_ms = atoi(optarg); break;
+        case 'j': opts.jitter_ms = atoi(optarg); break;
+        case 'f': opts.fragment_bytes = atoi(optarg); break;
+        case 'g': opts.fragment_gap_us = atoi(optarg); break;
+        case 'u': opts.urc_interval_ms = atoi(optarg); break;
+        case 'U':
+            if (opts.urc_count < MAX_URCS) {
+                opts.urcs[opts.urc_count++] = optarg;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r script] [-c config] [-l link] [-n ports] [-d latency_ms] [-j jitter_ms]\n"
+                            "       [-f fragment_bytes] [-g fragment_gap_us] [-u urc_interval_ms] [-U urc_line]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (port_count < 1 || port_count > MAX_PORTS) {
+        fprintf(stderr, "Number of ports must be between 1 and %d\n", MAX_PORTS);
+        return 1;
+    }
+
+    if (opts.urc_count == 0) {
+        for (size_t i = 0; i < sizeof(default_urcs) / sizeof(default_urcs[0]); i++) {
+            opts.urcs[opts.urc_count++] = (char *)default_urcs[i];
+        }
+    }
+
+    // Scripted responses take precedence over the canned ones
+    if (script != NULL && load_script(script) != 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(canned) / sizeof(canned[0]); i++) {
+        if (find_entry(canned[i][0], NULL) != NULL) {
+            continue; // Scripted
+        }
+        if (add_entry(canned[i][0], canned[i][1], -1) != 0) {
+            return 1;
+        }
+    }
+
+    if (config != NULL) {
+        check_config_coverage(config);
+    }
+
+    // Every port holds a master and a slave descriptor
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)port_count * 2 + 16) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct sim_port *ports = calloc(port_count, sizeof(struct sim_port));
+    struct pollfd *pfds = calloc(port_count, sizeof(struct pollfd));
+    char (*links)[256] = calloc(port_count, sizeof(*links));
+    if (ports == NULL || pfds == NULL || links == NULL) {
+        perror("Error allocating memory for ports");
+        return 1;
+    }
+
+    int opened = 0;
+    for (; opened < port_count; opened++) {
+        if (link != NULL) {
+            if (numbered) {
+                snprintf(links[opened], sizeof(links[opened]), "%s%d", link, opened);
+            } else {
+                snprintf(links[opened], sizeof(links[opened]), "%s", link);
+            }
+        }
+        if (open_port(&ports[opened], link != NULL ? links[opened] : NULL) != 0) {
+            break;
+        }
+        pfds[opened].fd = ports[opened].master;
+        pfds[opened].events = POLLIN;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    srand(time(NULL));
+
+    if (opened == port_count) {
+        for (int i = 0; i < port_count; i++) {
+            printf("%s\n", ports[i].slave_name);
+        }
+        fflush(stdout);
+    } else {
+        running = 0;
+    }
+
+    long long start = monotonic_us();
+    for (int i = 0; i < opened; i++) {
+        ports[i].next_urc = opts.urc_interval_ms > 0 ? start + opts.urc_interval_ms * 1000LL : 0;
+    }
+
+    while (running) {
+        long long now = monotonic_us();
+
+        // Sleep until input arrives or the next timed event of any port is due
+        long long wake = now + 1000000;
+        for (int i = 0; i < port_count; i++) {
+            struct sim_port *port = &ports[i];
+            service_port(port, &opts, now);
+            if (port->pending_due && port->pending_due < wake) wake = port->pending_due;
+            if (port->out_pos < port->out_len && port->next_write < wake) wake = port->next_write;
+            if (port->next_urc && port->next_urc < wake) wake = port->next_urc;
+        }
+        int timeout = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+
+        if (poll(pfds, port_count, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        for (int i = 0; i < port_count; i++) {
+            if (pfds[i].revents & POLLIN) {
+                receive_input(&ports[i], &opts);
+            }
+        }
+    }
+
+    for (int i = 0; i < opened; i++) {
+        if (link != NULL) {
+            unlink(links[i]);
+        }
+        close(ports[i].master);
+        close(ports[i].slave);
+    }
+    free(ports);
+    free(pfds);
+    free(links);
+    return opened == port_count ? 0 : 1;
+}
+
+// Function to get a monotonic timestamp in microseconds
+long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Function to register a response
+int add_entry(const char *command, const char *body, int latency_ms) {
+    if (entry_count >= MAX_SCRIPT_ENTRIES) {
+        fprintf(stderr, "Too many script entries (max %d)\n", MAX_SCRIPT_ENTRIES);
+        return -1;
+    }
+
+    struct sim_entry *entry = &entries[entry_count];
+    entry->command = strdup(command);
+    entry->body = strdup(body);
+    if (entry->command == NULL || entry->body == NULL) {
+        perror("Error allocating memory for script entry");
+        return -1;
+    }
+    entry->latency_ms = latency_ms;
+    entry_count++;
+    return 0;
+}
+
+// Function to load scripted responses from a file
+int load_script(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror("Error opening script file");
+        return -1;
+    }
+
+    char line[LINE_MAX_LEN];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+
+        char *arrow = strstr(line, "=>");
+        if (arrow == NULL) {
+            fprintf(stderr, "%s:%d: expected 'COMMAND => body'\n", filename, line_number);
+            continue;
+        }
+        *arrow = '\0';
+
+        // Optional per-command latency: COMMAND @ms
+        int latency_ms = -1;
+        char *at = strrchr(line, '@');
+        if (at != NULL) {
+            latency_ms = atoi(at + 1);
+            *at = '\0';
+        }
+
+        char *command = line;
+        while (isspace((unsigned char)*command)) command++;
+        char *end = command + strlen(command);
+        while (end > command && isspace((unsigned char)end[-1])) *--end = '\0';
+
+        // Expand "\n" escapes into CRLF line breaks
+        char body[LINE_MAX_LEN * 2];
+        size_t len = 0;
+        const char *src = arrow + 2;
+        while (isspace((unsigned char)*src)) src++;
+        for (; *src && len < sizeof(body) - 3; src++) {
+            if (src[0] == '\\' && src[1] == 'n') {
+                body[len++] = '\r';
+                body[len++] = '\n';
+                src++;
+            } else {
+                body[len++] = *src;
+            }
+        }
+        body[len] = '\0';
+
+        if (add_entry(command, body, latency_ms) != 0) {
+            fclose(file);
+            return -1;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// Function to report the monitor's commands that have no response
+void check_config_coverage(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        perror("Error opening configuration file");
+        return;
+    }
+
+    char line[256];
+    int in_commands_block = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncasecmp(line, "commands:", 9) == 0) {
+            in_commands_block = 1;
+            continue;
+        }
+        if (!in_commands_block) {
+            continue;
+        }
+        if (line[0] == '}') {
+            break;
+        }
+
+        for (char *cmd = strtok(line, ",{}\r\n"); cmd != NULL; cmd = strtok(NULL, ",{}\r\n")) {
+            while (isspace((unsigned char)*cmd) || *cmd == '"') cmd++;
+            size_t len = strcspn(cmd, " \t@\"");
+            if (len == 0) {
+                continue;
+            }
+            cmd[len] = '\0';
+            if (find_entry(cmd, NULL) == NULL && strchr(cmd, '=') == NULL) {
+                fprintf(stderr, "No response for '%s', it will be answered with ERROR\n", cmd);
+            }
+        }
+    }
+
+    fclose(file);
+}
+
+// Function to find the next response for a command
+// Repeated commands in the script are used in turn, counted in turns[] so every
+// port has its own sequence. With turns NULL the first entry is returned.
+struct sim_entry *find_entry(const char *command, unsigned int turns[]) {
+    int first_index = -1;
+    struct sim_entry *first = NULL;
+    int matches = 0;
+
+    for (int i = 0; i < entry_count; i++) {
+        if (strcasecmp(entries[i].command, command) == 0) {
+            if (first == NULL) {
+                first = &entries[i];
+                first_index = i;
+            }
+            matches++;
+        }
+    }
+    if (first == NULL || matches == 1 || turns == NULL) {
+        return first;
+    }
+
+    // Cycle through the responses registered for this command
+    int turn = turns[first_index]++ % matches;
+    for (int i = 0; i < entry_count; i++) {
+        if (strcasecmp(entries[i].command, command) == 0 && turn-- == 0) {
+            return &entries[i];
+        }
+    }
+    return first;
+}
+
+// Function to build the response to a (possibly compound) command line
+// Returns the number of bytes written to out.
+int answer_command(struct sim_port *port, const char *line, char *out, size_t max_len, int *latency_ms) {
+    char copy[LINE_MAX_LEN];
+    size_t len = 0;
+    int failed = 0;
+
+    snprintf(copy, sizeof(copy), "%s", line);
+    *latency_ms = 0;
+
+    // Compound lines: AT+CSQ;+CREG? runs AT+CSQ then AT+CREG?
+    char *save = NULL;
+    int first = 1;
+    for (char *part = strtok_r(copy, ";", &save); part != NULL && !failed; part = strtok_r(NULL, ";", &save), first = 0) {
+        char command[LINE_MAX_LEN];
+        if (first) {
+            snprintf(command, sizeof(command), "%s", part);
+        } else {
+            snprintf(command, sizeof(command), "AT%s", part);
+        }
+
+        if (strcasecmp(command, "AT") == 0) {
+            continue;
+        } else if (strcasecmp(command, "ATE0") == 0) {
+            port->echo = 0;
+            continue;
+        } else if (strcasecmp(command, "ATE1") == 0) {
+            port->echo = 1;
+            continue;
+        }
+
+        struct sim_entry *entry = find_entry(command, port->turns);
+        if (entry == NULL) {
+            // Unknown set commands are accepted, anything else is rejected
+            if (strchr(command, '=') != NULL && strchr(command, '?') == NULL) {
+                continue;
+            }
+            failed = 1;
+            break;
+        }
+
+        if (entry->latency_ms > 0) {
+            *latency_ms += entry->latency_ms;
+        }
+        if (strcmp(entry->body, "ERROR") == 0 || strncmp(entry->body, "+CME ERROR", 10) == 0) {
+            len += snprintf(out + len, max_len - len, "\r\n%s\r\n", entry->body);
+            return len < max_len ? (int)len : (int)max_len - 1;
+        }
+        if (entry->body[0] != '\0') {
+            len += snprintf(out + len, max_len - len, "\r\n%s\r\n", entry->body);
+            if (len >= max_len) {
+                len = max_len - 1;
+            }
+        }
+    }
+
+    len += snprintf(out + len, max_len - len, "\r\n%s\r\n", failed ? "ERROR" : "OK");
+    return len < max_len ? (int)len : (int)max_len - 1;
+}
+
+// Function to handle a command line received from the monitor
+void handle_line(struct sim_port *port, const struct sim_options *opts, const char *line) {
+    // Echo the line as it was received
+    if (port->echo) {
+        queue_output(port, line, strlen(line));
+        queue_output(port, "\r", 1);
+    }
+
+    if (line[0] == '\0') {
+        return;
+    }
+
+    // A response still held back is overtaken by the new command
+    if (port->pending_due) {
+        queue_output(port, port->pending, port->pending_len);
+    }
+
+    int latency_ms;
+    port->pending_len = answer_command(port, line, port->pending, sizeof(port->pending), &latency_ms);
+
+    int delay = latency_ms > 0 ? latency_ms : opts->latency_ms;
+    if (opts->jitter_ms > 0) {
+        delay += rand() % (2 * opts->jitter_ms + 1) - opts->jitter_ms;
+    }
+    if (delay < 0) {
+        delay = 0;
+    }
+    port->pending_due = monotonic_us() + delay * 1000LL;
+}
+
+// Function to append bytes to the output queue of a port
+void queue_output(struct sim_port *port, const char *data, size_t len) {
+    // Reclaim the space of bytes already written
+    if (port->out_pos > 0) {
+        memmove(port->out, port->out + port->out_pos, port->out_len - port->out_pos);
+        port->out_len -= port->out_pos;
+        port->out_pos = 0;
+    }
+
+    if (len > sizeof(port->out) - port->out_len) {
+        len = sizeof(port->out) - port->out_len; // Monitor is not reading, drop the excess
+    }
+    memcpy(port->out + port->out_len, data, len);
+    port->out_len += len;
+}
+
+// Function to release due responses and URCs and write queued bytes
+void service_port(struct sim_port *port, const struct sim_options *opts, long long now) {
+    if (port->pending_due && now >= port->pending_due) {
+        queue_output(port, port->pending, port->pending_len);
+        port->pending_due = 0;
+        port->pending_len = 0;
+    }
+
+    // URCs are only injected while no response is in flight
+    if (port->next_urc && now >= port->next_urc) {
+        if (!port->pending_due && port->out_pos == port->out_len) {
+            char urc[LINE_MAX_LEN];
+            int len = snprintf(urc, sizeof(urc), "\r\n%s\r\n", opts->urcs[port->urc_index++ % opts->urc_count]);
+            queue_output(port, urc, len);
+        }
+        port->next_urc = now + opts->urc_interval_ms * 1000LL;
+    }
+
+    while (port->out_pos < port->out_len && now >= port->next_write) {
+        size_t chunk = port->out_len - port->out_pos;
+        if (opts->fragment_bytes > 0 && chunk > (size_t)opts->fragment_bytes) {
+            chunk = opts->fragment_bytes;
+        }
+
+        ssize_t n = write(port->master, port->out + port->out_pos, chunk);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("write");
+            }
+            break;
+        }
+        port->out_pos += n;
+
+        if (opts->fragment_bytes > 0 && opts->fragment_gap_us > 0) {
+            port->next_write = now + opts->fragment_gap_us;
+            break;
+        }
+    }
+}
+
+// Function to read the monitor's bytes and handle every complete command line
+void receive_input(struct sim_port *port, const struct sim_options *opts) {
+    char buf[1024];
+    ssize_t n = read(port->master, buf, sizeof(buf));
+    for (ssize_t i = 0; i < n; i++) {
+        if (buf[i] == '\r') {
+            port->in[port->in_len] = '\0';
+            handle_line(port, opts, port->in);
+            port->in_len = 0;
+        } else if (buf[i] != '\n' && port->in_len < sizeof(port->in) - 1) {
+            port->in[port->in_len++] = buf[i];
+        }
+    }
+}
+
+// Function to create the pseudo terminal
+int open_port(struct sim_port *port, const char *link) {
+    memset(port, 0, sizeof(*port));
+    port->echo = 1;
+
+    if (openpty(&port->master, &port->slave, port->slave_name, NULL, NULL) != 0) {
+        perror("openpty");
+        return -1;
+    }
+
+    // Raw mode, so the line discipline leaves the monitor's bytes alone
+    struct termios tty;
+    if (tcgetattr(port->slave, &tty) == 0) {
+        cfmakeraw(&tty);
+        tcsetattr(port->slave, TCSANOW, &tty);
+    }
+    fcntl(port->master, F_SETFL, fcntl(port->master, F_GETFL) | O_NONBLOCK);
+
+    if (link != NULL) {
+        unlink(link);
+        if (symlink(port->slave_name, link) != 0) {
+            perror("symlink");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Signal handler for graceful termination
+void signal_handler(int signum) {
+    (void)signum;
+    running = 0;
+}